@@ -5,24 +5,47 @@
 #endif
 
 #include "crow_all.h" 
-#include <mysql.h>    
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+#include <mysql.h>
+#include <errmsg.h>
+#include <mysqld_error.h>    
 #include <nlohmann/json.hpp>
 #include <cpr/cpr.h>
+#include <curl/curl.h>
+#include <zlib.h>
 #include <iomanip>
 
 #include <iostream>
 #include <vector>
 #include <string>
 #include <sstream>
+#include <fstream>
 #include <memory>
 #include <mutex>
 #include <queue>
+#include <deque>
 #include <future>
 #include <chrono>
 #include <atomic>
 #include <thread>
 #include <algorithm>
 #include <set>
+#include <random>
+#include <cstdlib>
+#include <filesystem>
+#include <cstddef>
+#include <map>
+#include <list>
+#include <unordered_map>
+#include <functional>
+#include <type_traits>
 
 using json = nlohmann::json;
 using namespace std;
@@ -34,12 +57,385 @@ const char* DB_USER = "sfuser";
 const char* DB_PASS = "1q2w3e4R"; 
 const char* DB_NAME = "sfdb4070"; 
 
+const int   SERVER_PORT = 2151;
+
+// 環境變數覆寫 (同一台機器啟動多個 instance 測試時使用)
+string getEnvOr(const char* name, const string& def) {
+    const char* v = std::getenv(name);
+    return (v && *v) ? string(v) : def;
+}
+int getEnvIntOr(const char* name, int def) {
+    const char* v = std::getenv(name);
+    if (!v || !*v) return def;
+    try { return std::stoi(v); } catch (...) { return def; }
+}
+
+// 執行個體 ID：多台 backend 共用 2DID_unsent_messages 時用來認領 (lease) 補送資料
+string makeInstanceId() {
+    string id = getEnvOr("BACKEND_INSTANCE_ID", "");
+    if (!id.empty()) return id;
+    string host = getEnvOr("COMPUTERNAME", getEnvOr("HOSTNAME", "backend"));
+    std::random_device rd;
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), "%08x", (unsigned)rd());
+    return host + ":" + to_string(getEnvIntOr("BACKEND_PORT", SERVER_PORT)) + ":" + suffix;
+}
+const string INSTANCE_ID = makeInstanceId();
+
 const string IIS_API_URL = "http://ksrv-web-ap3.flexium.local/gxfirstOIS/gxfirstOIS.asmx/GetOISData";
 const string SOAP_URL = "http://10.8.1.124/MESConnect.svc";
 const string SOAP_ACTION = "http://tempuri.org/IMESConnect/UpLoadImage";
 
-// ✅ [Req 2] 全域變數：MES 連線狀態
-std::atomic<bool> g_isMesOnline{true};
+// 工單快取最多保留幾張工單 (每張含完整預期清單與掃描紀錄)
+const size_t WO_CACHE_CAPACITY = 64;
+// 工單快取的存活時間：多台 instance 共用同一個 DB 時，其他台寫入的工單 / 掃描紀錄最多延遲這麼久才會看到
+// (失效與掃描更新只通知本機快取)。確定只有單一 instance 時可設為 0 (不過期)
+const int    WO_CACHE_TTL_MS = 3000;
+
+// 掃描紀錄 write-behind (group commit) 設定
+// Sync : 等待所在批次 COMMIT 後才回應前端；Async: 放入佇列即回應
+enum class ScanDurability { Async, Sync };
+const ScanDurability SCAN_DURABILITY = ScanDurability::Sync;
+const size_t SCAN_QUEUE_CAPACITY = 20000;       // 佇列上限 (筆)
+const size_t SCAN_GROUP_COMMIT_MAX_ROWS = 2000; // 單一交易最多筆數
+const int    SCAN_GROUP_COMMIT_MS = 5;          // 等待其他請求一起 commit 的時間
+const int    SCAN_ENQUEUE_TIMEOUT_MS = 200;     // 佇列滿時最多等待多久，逾時改為同步寫入
+const int    SCAN_SYNC_WAIT_MS = 5000;          // Sync 模式等待 commit 的上限
+
+// OK_sum / NG_sum 增量寫入間隔：0 = 每批掃描紀錄結束時於同一交易寫入，>0 = 累積在記憶體後定時寫入
+const int    COUNTER_FLUSH_INTERVAL_MS = 0;
+
+// 本地 outbox：MES 未送出訊息先落地到 memory-mapped segment 檔，再由 MonitorLoop 轉存 DB / 補送
+const string OUTBOX_DIR = "outbox";
+const size_t OUTBOX_SEGMENT_BYTES = 4 * 1024 * 1024; // 每個 segment 檔大小
+const int    OUTBOX_FSYNC_INTERVAL_MS = 50;          // 批次 flush 到磁碟的間隔
+const size_t OUTBOX_DRAIN_BATCH = 200;               // 每次轉存 DB 的筆數
+
+// 積壓訊息補送：並行 worker 數 (不同工單並行，同工單依序)、批次大小範圍
+const size_t REPLAY_WINDOW = 8;
+const size_t REPLAY_CLAIM_WORKORDERS = 32;  // 每次認領幾張工單的積壓資料
+const int    REPLAY_LEASE_SEC = 60;         // 認領租約長度，instance 當掉時逾期由其他 instance 接手
+const int    REPLAY_RENEW_INTERVAL_MS = 5000; // 送出期間每隔多久刪除已送出的 id 並續約 (須遠小於租約長度)
+const size_t REPLAY_MIN_BATCH = 10;
+const size_t REPLAY_MAX_BATCH = 1000;
+const int    REPLAY_COUNT_INTERVAL_SEC = 5; // 重新 COUNT(*) 積壓筆數的間隔
+
+// MES 斷路器：依各 command 的滾動視窗判斷是否跳脫，冷卻後以實際流量半開試探
+const int    BREAKER_WINDOW_CALLS = 20;         // 每個 command 的滾動視窗筆數
+const int    BREAKER_MIN_CALLS = 5;             // 視窗內至少幾筆才計算比率
+const double BREAKER_FAILURE_RATE = 0.5;        // 失敗率門檻
+const double BREAKER_SLOW_CALL_RATE = 0.8;      // 慢呼叫比率門檻
+const int    BREAKER_SLOW_CALL_MS = 2000;       // 超過此時間視為慢呼叫
+const int    BREAKER_CONSECUTIVE_FAILURES = 3;  // 連續失敗幾次直接跳脫
+const int    BREAKER_OPEN_MS = 5000;            // 跳脫後冷卻時間
+const int    BREAKER_HALF_OPEN_TRIALS = 3;      // 半開時允許的試探請求數 (全部成功才恢復)
+
+// /api/write2dids 的 MES 非同步 client：同時進行中的請求數 (同時也是 keep-alive 連線上限)
+const size_t MES_ASYNC_WINDOW = 16;
+
+// 全域 executor：執行緒數 (可用環境變數 BACKEND_WORKER_THREADS 覆寫) 與佇列上限
+const int    WORKER_THREADS = 4;
+const size_t WORKER_QUEUE_CAPACITY = 1024;
+
+// MySQL 連線池：平時維持 DB_POOL_MIN 條，尖峰最多 DB_POOL_MAX 條，借不到連線時最多等待 DB_POOL_WAIT_MS
+const size_t DB_POOL_MIN = 10;
+const size_t DB_POOL_MAX = 32;
+const int    DB_POOL_WAIT_MS = 3000;
+const int    DB_POOL_IDLE_PING_SEC = 30;    // 閒置超過此時間由背景 ping 檢查
+const int    DB_POOL_IDLE_SHRINK_SEC = 60;  // 超過 min 的連線閒置超過此時間即關閉
+const int    DB_POOL_MAINTAIN_MS = 1000;    // 背景維護間隔
+const size_t STMT_CACHE_PER_CONN = 64;      // 每條連線最多快取的 prepared statement 數
+
+// /api/workorder 查無快取時 235 與 236 同時送出 (可用環境變數 BACKEND_SPECULATIVE_236=1/0 覆寫)
+// 舊工單省一次 MES 往返，代價是新工單多送一次 236
+const bool   WORKORDER_SPECULATIVE_236 = false;
+
+// 非同步 Logger：寫入 LOG_DIR/backend.log，超過 LOG_FILE_MAX_BYTES 輪替，保留 LOG_FILE_KEEP 個舊檔
+// 各 category 的等級可用環境變數 BACKEND_LOG_LEVELS 覆寫 (例如 "*=info,http=warn,DB=debug")
+const char*  LOG_DIR = "logs";
+const size_t LOG_FILE_MAX_BYTES = 10 * 1024 * 1024;
+const int    LOG_FILE_KEEP = 5;
+const bool   LOG_TO_CONSOLE = true;
+const size_t LOG_RING_CAPACITY = 8192;      // 必須是 2 的次方
+const size_t LOG_BATCH_MAX = 1024;          // 背景執行緒每次最多寫出的筆數
+const int    LOG_FLUSH_INTERVAL_MS = 20;
+const char*  LOG_LEVELS = "http/heartbeat=off"; // 預設不記錄 heartbeat 的請求 / 回應
+
+// 每個執行緒保留的輸出緩衝區上限 (gzip 輸出 / /api/workorder 預留大小)，超過時用完即釋放 (避免偶發的超大回應長期佔用記憶體)
+const size_t JSON_BUFFER_KEEP_BYTES = 1 << 20;
+
+// 回應壓縮：client 的 Accept-Encoding 含 gzip / deflate 且 body 至少 HTTP_COMPRESS_MIN_BYTES 才壓縮
+// (/heartbeat 之類的小回應壓縮後反而更大，且白花 CPU)
+const size_t HTTP_COMPRESS_MIN_BYTES = 1024;
+const int    HTTP_COMPRESS_LEVEL = 6;       // 1 (最快) ~ 9 (最小)
+
+// /api/pcs_read 的總筆數快取：相同篩選條件在 TTL 內不重跑 COUNT(*)
+const int    PCS_COUNT_CACHE_TTL_MS = 5000;
+const size_t PCS_COUNT_CACHE_CAPACITY = 256;
+
+// /api/pcs_write_batch 單次請求最多筆數
+const size_t PCS_BATCH_MAX_ITEMS = 2000;
+
+// /api/pcs_export 的暫存檔目錄，超過 EXPORT_FILE_TTL_SEC 的檔案在下次匯出時清除
+const string EXPORT_DIR = "exports";
+const int    EXPORT_FILE_TTL_SEC = 600;
+
+// 機台 / PLC 設定快取 (幾乎不變的資料)：超過 TTL 後先回傳舊值並在背景重新載入；
+// MES 或 DB 無法連線時持續回傳最後一次成功的資料 (回應的 cache.age_sec 為資料年齡)
+const int    CONFIG_TTL_MACHINE_CODE_SEC = 3600; // mes_machine：PM 碼 -> 機台代碼
+const int    CONFIG_TTL_CMD254_SEC = 600;        // MES CMD 254：機台硬體配置
+const int    CONFIG_TTL_PLC_SEC = 300;           // 2did_machine_info：PLC 連線參數
+
+// 多列 INSERT 每批的列數 (列數 x 欄位數不可超過 65535 個 placeholder)
+const size_t BULK_INSERT_CHUNK_ROWS = 500;
+
+// --- 非同步 Logger ---
+// ✅ [效能優化] 取代 request thread 上直接 cout << endl 的寫法：
+// - 呼叫端只把訊息放進固定大小的 lock-free ring buffer (滿了就丟棄並計數，不會卡住 API)
+// - 背景執行緒統一格式化時間、整批寫入 console 與 logs/ 下的輪替檔案
+// - 依 category 設定等級 (例如 "http/heartbeat=off")，取代原本寫死的 "/heartbeat" 字串比對
+enum class LogSeverity { Debug = 0, Info, Warning, Error, Critical, Off };
+
+class AsyncLogger {
+public:
+    AsyncLogger() : m_cells(LOG_RING_CAPACITY) {
+        for (size_t i = 0; i < m_cells.size(); ++i) m_cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+    ~AsyncLogger() { stop(); }
+
+    // spec: "cat=level,cat=level" (level: debug/info/warn/error/critical/off)；"*" 代表預設等級
+    void configure(const string& spec) {
+        std::stringstream ss(spec);
+        string item;
+        while (std::getline(ss, item, ',')) {
+            size_t eq = item.find('=');
+            if (eq == string::npos) continue;
+            string cat = item.substr(0, eq), lv = item.substr(eq + 1);
+            LogSeverity sev = parseSeverity(lv);
+            if (cat == "*") m_default = sev;
+            else m_levels[cat] = sev;
+        }
+    }
+
+    void start(const string& dir) {
+        if (m_thread.joinable()) return;
+        m_dir = dir;
+        std::error_code ec;
+        std::filesystem::create_directories(m_dir, ec);
+        openFile();
+        m_stop = false;
+        m_thread = thread([this] { run(); });
+    }
+
+    void stop() {
+        if (!m_thread.joinable()) return;
+        m_stop = true;
+        m_thread.join();
+        if (m_file) { fclose(m_file); m_file = nullptr; }
+    }
+
+    // category 設定在啟動時完成，之後只讀，不需要鎖
+    // 找不到時往上一層找 (例如 "http/heartbeat" -> "http")
+    bool enabled(LogSeverity sev, const string& category) const {
+        if (m_levels.empty()) return sev >= m_default;
+        string cat = category;
+        while (true) {
+            auto it = m_levels.find(cat);
+            if (it != m_levels.end()) return sev >= it->second;
+            size_t slash = cat.rfind('/');
+            if (slash == string::npos) break;
+            cat.resize(slash);
+        }
+        return sev >= m_default;
+    }
+
+    // 多個 producer 同時寫入 (Vyukov bounded queue)；滿了直接丟棄
+    void write(LogSeverity sev, string category, string message) {
+        size_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &m_cells[pos & (m_cells.size() - 1)];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                m_dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            } else {
+                pos = m_enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+        cell->rec.ts = std::chrono::system_clock::now();
+        cell->rec.sev = sev;
+        cell->rec.category = std::move(category);
+        cell->rec.message = std::move(message);
+        cell->seq.store(pos + 1, std::memory_order_release);
+    }
+
+    json stats() const {
+        return json{{"capacity", m_cells.size()}, {"written", m_written.load()}, {"dropped", m_dropped.load()},
+                    {"file", m_path}};
+    }
+
+private:
+    struct Record {
+        std::chrono::system_clock::time_point ts;
+        LogSeverity sev = LogSeverity::Info;
+        string category;
+        string message;
+    };
+    struct Cell {
+        std::atomic<size_t> seq;
+        Record rec;
+    };
+
+    static LogSeverity parseSeverity(string s) {
+        std::transform(s.begin(), s.end(), s.begin(), ::tolower);
+        if (s == "debug") return LogSeverity::Debug;
+        if (s == "warn" || s == "warning") return LogSeverity::Warning;
+        if (s == "error") return LogSeverity::Error;
+        if (s == "critical") return LogSeverity::Critical;
+        if (s == "off") return LogSeverity::Off;
+        return LogSeverity::Info;
+    }
+
+    // 單一 consumer (背景執行緒)
+    bool read(Record& out) {
+        Cell& cell = m_cells[m_dequeuePos & (m_cells.size() - 1)];
+        size_t seq = cell.seq.load(std::memory_order_acquire);
+        if ((intptr_t)seq - (intptr_t)(m_dequeuePos + 1) < 0) return false;
+        out = std::move(cell.rec);
+        cell.seq.store(m_dequeuePos + m_cells.size(), std::memory_order_release);
+        m_dequeuePos++;
+        return true;
+    }
+
+    void openFile() {
+        m_path = (std::filesystem::path(m_dir) / "backend.log").string();
+        m_file = fopen(m_path.c_str(), "ab");
+        m_fileBytes = 0;
+        if (m_file) {
+            fseek(m_file, 0, SEEK_END);
+            m_fileBytes = (size_t)ftell(m_file);
+        }
+    }
+
+    // backend.log -> backend.1.log -> ... -> backend.N.log (最舊的刪除)
+    void rotate() {
+        if (m_file) { fclose(m_file); m_file = nullptr; }
+        std::error_code ec;
+        auto name = [&](int i) { return std::filesystem::path(m_dir) / ("backend." + to_string(i) + ".log"); };
+        std::filesystem::remove(name(LOG_FILE_KEEP), ec);
+        for (int i = LOG_FILE_KEEP - 1; i >= 1; --i) std::filesystem::rename(name(i), name(i + 1), ec);
+        std::filesystem::rename(m_path, name(1), ec);
+        openFile();
+    }
+
+    void format(const Record& r, string& out) {
+        static const char* names[] = {"DEBUG", "INFO ", "WARN ", "ERROR", "CRIT "};
+        std::time_t t = std::chrono::system_clock::to_time_t(r.ts);
+        // 同一秒內的訊息共用格式化結果
+        if (t != m_lastSec) {
+            std::tm tm_buf{};
+            #ifdef _WIN32
+                localtime_s(&tm_buf, &t);
+            #else
+                localtime_r(&t, &tm_buf);
+            #endif
+            std::strftime(m_lastSecStr, sizeof(m_lastSecStr), "%Y-%m-%d %H:%M:%S", &tm_buf);
+            m_lastSec = t;
+        }
+        out += "(";
+        out += m_lastSecStr;
+        out += ") [";
+        out += names[std::min((int)r.sev, 4)];
+        out += "] [";
+        out += r.category;
+        out += "] ";
+        out += r.message;
+        out += "\n";
+    }
+
+    void run() {
+        string batch;
+        Record rec;
+        uint64_t reportedDrops = 0;
+        while (true) {
+            batch.clear();
+            size_t n = 0;
+            while (n < LOG_BATCH_MAX && read(rec)) {
+                format(rec, batch);
+                n++;
+            }
+            uint64_t drops = m_dropped.load(std::memory_order_relaxed);
+            if (drops != reportedDrops) {
+                Record w;
+                w.ts = std::chrono::system_clock::now();
+                w.sev = LogSeverity::Warning;
+                w.category = "Log";
+                w.message = "Ring buffer full, dropped " + to_string(drops - reportedDrops) + " messages";
+                format(w, batch);
+                reportedDrops = drops;
+            }
+
+            if (!batch.empty()) {
+                if (LOG_TO_CONSOLE) {
+                    fwrite(batch.data(), 1, batch.size(), stdout);
+                    fflush(stdout);
+                }
+                if (m_file) {
+                    fwrite(batch.data(), 1, batch.size(), m_file);
+                    fflush(m_file);
+                    m_fileBytes += batch.size();
+                    if (m_fileBytes >= LOG_FILE_MAX_BYTES) rotate();
+                }
+                m_written += n;
+                continue; // 還有資料就繼續寫
+            }
+            if (m_stop) break;
+            std::this_thread::sleep_for(std::chrono::milliseconds(LOG_FLUSH_INTERVAL_MS));
+        }
+    }
+
+    vector<Cell> m_cells;
+    std::atomic<size_t> m_enqueuePos{0};
+    size_t m_dequeuePos = 0;
+    std::atomic<uint64_t> m_dropped{0}, m_written{0};
+
+    LogSeverity m_default = LogSeverity::Info;
+    unordered_map<string, LogSeverity> m_levels;
+
+    string m_dir, m_path;
+    FILE* m_file = nullptr;
+    size_t m_fileBytes = 0;
+    std::time_t m_lastSec = 0;
+    char m_lastSecStr[20] = {};
+
+    thread m_thread;
+    std::atomic<bool> m_stop{false};
+};
+
+AsyncLogger g_log;
+
+// 串流式寫法：LOG_INFO("MES") << "..." << x;  等級未開啟時不會組字串
+class LogLine {
+public:
+    LogLine(LogSeverity sev, const char* category) : m_sev(sev), m_category(category) {}
+    ~LogLine() { g_log.write(m_sev, m_category, m_ss.str()); }
+    template<class T> LogLine& operator<<(const T& v) { m_ss << v; return *this; }
+private:
+    LogSeverity m_sev;
+    const char* m_category;
+    std::ostringstream m_ss;
+};
+
+// 用 for 包裝而不是 if/else，避免呼叫端寫 if (...) LOG_xxx(...) << ...; 時出現 dangling else
+#define LOG_AT(sev, cat) for (bool log_on_ = g_log.enabled(sev, cat); log_on_; log_on_ = false) LogLine(sev, cat)
+#define LOG_DEBUG(cat) LOG_AT(LogSeverity::Debug, cat)
+#define LOG_INFO(cat)  LOG_AT(LogSeverity::Info, cat)
+#define LOG_WARN(cat)  LOG_AT(LogSeverity::Warning, cat)
+#define LOG_ERROR(cat) LOG_AT(LogSeverity::Error, cat)
 
 // --- 資料結構 ---
 struct WorkOrderData {
@@ -55,79 +451,410 @@ struct ScannedData {
     long long timestamp;
 };
 
-// --- Simple Thread Pool ---
-class ThreadPool {
-    vector<thread> workers;
-    queue<function<void()>> tasks;
-    mutex queue_mutex;
-    condition_variable condition;
-    bool stop;
+// --- Metrics (Prometheus) ---
+// ✅ [新增] 提供 /metrics 使用的 histogram。每個執行緒寫入自己的 shard (單一寫入者，只做 relaxed load/store，
+// 不需要鎖也沒有 cache line 爭用)，抓取時才把所有 shard 加總。
+// series 以 (名稱, labels) 登記，第一次使用時才需要上鎖，之後由 thread_local 快取直接取得編號。
+class Metrics {
 public:
-    ThreadPool(size_t threads) : stop(false) {
-        for(size_t i = 0; i<threads; ++i)
-            workers.emplace_back([this] {
-                for(;;) {
-                    function<void()> task;
-                    {
-                        unique_lock<mutex> lock(this->queue_mutex);
-                        this->condition.wait(lock, [this]{ return this->stop || !this->tasks.empty(); });
-                        if(this->stop && this->tasks.empty()) return;
-                        task = std::move(this->tasks.front());
-                        this->tasks.pop();
-                    }
-                    task();
+    static constexpr size_t MAX_SERIES = 256;
+    static constexpr size_t NUM_BUCKETS = 12; // 最後一個是 +Inf
+
+    // 取得 series 編號 (例如 name="backend_mes_request_duration_seconds", labels="command=\"239\"")；
+    // 超過 MAX_SERIES 時回傳 -1，observe 會直接忽略
+    int series(const string& name, const string& labels) {
+        static thread_local unordered_map<string, int> tlCache;
+        string key = name + '\x1f' + labels;
+        auto it = tlCache.find(key);
+        if (it != tlCache.end()) return it->second;
+
+        int id;
+        {
+            lock_guard<mutex> lock(m_mutex);
+            auto git = m_index.find(key);
+            if (git != m_index.end()) {
+                id = git->second;
+            } else if (m_series.size() >= MAX_SERIES) {
+                id = -1;
+            } else {
+                id = (int)m_series.size();
+                m_series.push_back({name, labels});
+                m_index[key] = id;
+            }
+        }
+        tlCache[key] = id;
+        return id;
+    }
+
+    void observe(int id, double seconds) {
+        if (id < 0) return;
+        Shard& s = local();
+        size_t b = 0;
+        while (b < NUM_BUCKETS - 1 && seconds > BUCKETS[b]) ++b;
+        bump(s.buckets[id][b], 1);
+        bump(s.count[id], 1);
+        bump(s.sumUs[id], (uint64_t)(seconds * 1e6));
+    }
+
+    void observe(const string& name, const string& labels, double seconds) { observe(series(name, labels), seconds); }
+
+    // 輸出所有 histogram (Prometheus text format 0.0.4)
+    string render() {
+        vector<pair<string, string>> series;
+        vector<Shard*> shards;
+        {
+            lock_guard<mutex> lock(m_mutex);
+            series = m_series;
+            for (auto& s : m_shards) shards.push_back(s.get());
+        }
+
+        // 同一名稱的 series 必須連續輸出
+        std::map<string, vector<size_t>> byName;
+        for (size_t i = 0; i < series.size(); ++i) byName[series[i].first].push_back(i);
+
+        std::ostringstream out;
+        for (auto& kv : byName) {
+            out << "# TYPE " << kv.first << " histogram\n";
+            for (size_t id : kv.second) {
+                uint64_t buckets[NUM_BUCKETS] = {}, count = 0, sumUs = 0;
+                for (Shard* s : shards) {
+                    for (size_t b = 0; b < NUM_BUCKETS; ++b) buckets[b] += s->buckets[id][b].load(std::memory_order_relaxed);
+                    count += s->count[id].load(std::memory_order_relaxed);
+                    sumUs += s->sumUs[id].load(std::memory_order_relaxed);
                 }
-            });
+                const string& labels = series[id].second;
+                string sep = labels.empty() ? "" : ",";
+                uint64_t cumulative = 0;
+                for (size_t b = 0; b < NUM_BUCKETS; ++b) {
+                    cumulative += buckets[b];
+                    out << kv.first << "_bucket{" << labels << sep << "le=\"";
+                    if (b == NUM_BUCKETS - 1) out << "+Inf"; else out << BUCKETS[b];
+                    out << "\"} " << cumulative << "\n";
+                }
+                string braces = labels.empty() ? "" : "{" + labels + "}";
+                out << kv.first << "_sum" << braces << " " << sumUs / 1e6 << "\n";
+                out << kv.first << "_count" << braces << " " << count << "\n";
+            }
+        }
+        return out.str();
+    }
+
+    static void appendGauge(std::ostringstream& out, const string& name, const string& labels, double value) {
+        out << name;
+        if (!labels.empty()) out << "{" << labels << "}";
+        out << " " << value << "\n";
+    }
+
+private:
+    static constexpr double BUCKETS[NUM_BUCKETS - 1] = {0.001, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5};
+
+    struct Shard {
+        std::atomic<uint64_t> count[MAX_SERIES];
+        std::atomic<uint64_t> sumUs[MAX_SERIES];
+        std::atomic<uint64_t> buckets[MAX_SERIES][NUM_BUCKETS];
+    };
+
+    // 只有擁有該 shard 的執行緒會寫入，不需要 fetch_add
+    static void bump(std::atomic<uint64_t>& c, uint64_t n) {
+        c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    Shard& local() {
+        static thread_local Shard* tl = nullptr;
+        if (!tl) {
+            auto s = std::make_unique<Shard>(); // value-init：全部歸零
+            tl = s.get();
+            lock_guard<mutex> lock(m_mutex);
+            m_shards.push_back(std::move(s)); // 執行緒結束後 shard 保留，數值不會遺失
+        }
+        return *tl;
+    }
+
+    mutex m_mutex;
+    vector<pair<string, string>> m_series;
+    unordered_map<string, int> m_index;
+    vector<std::unique_ptr<Shard>> m_shards;
+};
+
+constexpr double Metrics::BUCKETS[];
+
+Metrics g_metrics;
+
+// --- Work-Stealing Executor ---
+// ✅ [效能優化] 取代原本單一 mutex + std::queue 的 ThreadPool：
+// - 每個 worker 有自己的 deque，外部提交以 round-robin 分配；閒置的 worker 從其他 deque 尾端偷工作
+// - 佇列有上限 (capacity)：enqueue() 滿了就阻塞等待，tryEnqueue() 可指定等待時間，逾時即拒絕
+// - 統計佇列深度、等待時間、執行時間，供 /api/system_stats 觀察
+class Executor {
+public:
+    Executor(string name, size_t threads, size_t capacity)
+        : m_name(std::move(name)), m_capacity(std::max<size_t>(1, capacity)) {
+        threads = std::max<size_t>(1, threads);
+        for (size_t i = 0; i < threads; ++i) m_queues.push_back(std::make_unique<WorkerQueue>());
+        for (size_t i = 0; i < threads; ++i) m_workers.emplace_back([this, i] { workerLoop(i); });
     }
-    template<class F, class... Args>
-    auto enqueue(F&& f, Args&&... args) -> future<typename result_of<F(Args...)>::type> {
-        using return_type = typename result_of<F(Args...)>::type;
-        auto task = make_shared<packaged_task<return_type()>>(bind(forward<F>(f), forward<Args>(args)...));
-        future<return_type> res = task->get_future();
+
+    ~Executor() {
         {
-            unique_lock<mutex> lock(queue_mutex);
-            if(stop) throw runtime_error("enqueue on stopped ThreadPool");
-            tasks.emplace([task](){ (*task)(); });
+            lock_guard<mutex> lock(m_mutex);
+            m_stop = true;
         }
-        condition.notify_one();
+        m_workCv.notify_all();
+        m_spaceCv.notify_all();
+        for (thread& w : m_workers) w.join();
+    }
+
+    // 佇列已滿時阻塞等待 (backpressure)；已停止時丟出例外
+    template<class F>
+    auto enqueue(F&& f) -> future<std::invoke_result_t<std::decay_t<F>>> {
+        future<std::invoke_result_t<std::decay_t<F>>> res;
+        if (!submit(std::forward<F>(f), res, nullptr)) throw runtime_error("enqueue on stopped Executor");
         return res;
     }
-    ~ThreadPool() {
-        { unique_lock<mutex> lock(queue_mutex); stop = true; }
-        condition.notify_all();
-        for(thread &worker: workers) worker.join();
+
+    // 最多等待 timeout，仍然沒有空位就拒絕 (回傳 false)
+    template<class F>
+    bool tryEnqueue(F&& f, future<std::invoke_result_t<std::decay_t<F>>>& out,
+                    std::chrono::milliseconds timeout = std::chrono::milliseconds(0)) {
+        return submit(std::forward<F>(f), out, &timeout);
+    }
+
+    size_t size() const { return m_workers.size(); }
+
+    json stats() const {
+        uint64_t done = m_completed.load();
+        return json{{"name", m_name}, {"threads", m_workers.size()}, {"capacity", m_capacity},
+                    {"queue_depth", m_queued.load()}, {"active", m_active.load()},
+                    {"submitted", m_submitted.load()}, {"completed", done}, {"rejected", m_rejected.load()},
+                    {"steals", m_steals.load()},
+                    {"avg_wait_ms", done ? m_waitUs.load() / 1000.0 / done : 0.0},
+                    {"max_wait_ms", m_maxWaitUs.load() / 1000.0},
+                    {"avg_run_ms", done ? m_runUs.load() / 1000.0 / done : 0.0}};
+    }
+
+private:
+    struct Task {
+        function<void()> fn;
+        std::chrono::steady_clock::time_point enqueued;
+    };
+    struct WorkerQueue {
+        mutex m;
+        std::deque<Task> q;
+    };
+
+    template<class F, class R>
+    bool submit(F&& f, future<R>& out, const std::chrono::milliseconds* timeout) {
+        // 1. 先取得佇列名額 (m_queued 包含已提交、尚未開始執行的工作)
+        if (!reserveSlot()) {
+            unique_lock<mutex> lock(m_mutex);
+            auto hasSpace = [this] { return m_stop || reserveSlot(); };
+            m_spaceWaiters++;
+            bool ok = timeout ? m_spaceCv.wait_for(lock, *timeout, hasSpace) : (m_spaceCv.wait(lock, hasSpace), true);
+            m_spaceWaiters--;
+            if (!ok) {
+                m_rejected++;
+                return false;
+            }
+            if (m_stop) return false;
+        } else if (m_stop) {
+            releaseSlot();
+            return false;
+        }
+
+        auto task = std::make_shared<packaged_task<R()>>(std::forward<F>(f));
+        out = task->get_future();
+
+        // 2. worker 自己提交的工作放回自己的 deque，外部提交以 round-robin 分配
+        size_t idx = (tl_owner == this) ? tl_index : (m_next++ % m_queues.size());
+        {
+            lock_guard<mutex> lock(m_queues[idx]->m);
+            m_queues[idx]->q.push_back(Task{[task] { (*task)(); }, std::chrono::steady_clock::now()});
+        }
+        m_submitted++;
+        {
+            // 先取得鎖再通知，避免 worker 檢查完條件、尚未進入等待時漏掉通知
+            lock_guard<mutex> lock(m_mutex);
+        }
+        m_workCv.notify_one();
+        return true;
+    }
+
+    bool reserveSlot() {
+        size_t cur = m_queued.load();
+        while (cur < m_capacity) {
+            if (m_queued.compare_exchange_weak(cur, cur + 1)) return true;
+        }
+        return false;
+    }
+
+    void releaseSlot() {
+        m_queued--;
+        if (m_spaceWaiters.load() > 0) {
+            lock_guard<mutex> lock(m_mutex);
+            m_spaceCv.notify_one();
+        }
+    }
+
+    // 自己的 deque 從前端取 (維持提交順序)，偷別人的從尾端取
+    bool takeTask(size_t self, Task& out) {
+        {
+            lock_guard<mutex> lock(m_queues[self]->m);
+            if (!m_queues[self]->q.empty()) {
+                out = std::move(m_queues[self]->q.front());
+                m_queues[self]->q.pop_front();
+                return true;
+            }
+        }
+        for (size_t k = 1; k < m_queues.size(); ++k) {
+            WorkerQueue& victim = *m_queues[(self + k) % m_queues.size()];
+            lock_guard<mutex> lock(victim.m);
+            if (!victim.q.empty()) {
+                out = std::move(victim.q.back());
+                victim.q.pop_back();
+                m_steals++;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void workerLoop(size_t self) {
+        tl_owner = this;
+        tl_index = self;
+        for (;;) {
+            Task t;
+            if (takeTask(self, t)) {
+                releaseSlot();
+                auto begin = std::chrono::steady_clock::now();
+                uint64_t waitUs = std::chrono::duration_cast<std::chrono::microseconds>(begin - t.enqueued).count();
+                m_active++;
+                t.fn(); // packaged_task 會把例外存進 future，不會拋出
+                m_active--;
+                m_waitUs += waitUs;
+                m_runUs += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin).count();
+                uint64_t prevMax = m_maxWaitUs.load();
+                while (waitUs > prevMax && !m_maxWaitUs.compare_exchange_weak(prevMax, waitUs)) {}
+                m_completed++;
+                continue;
+            }
+            unique_lock<mutex> lock(m_mutex);
+            // m_queued 在放入 deque 之前就已增加，可能短暫看到 >0 但 deque 還是空的，重試即可
+            m_workCv.wait(lock, [this] { return m_stop || m_queued.load() > 0; });
+            if (m_stop && m_queued.load() == 0) return;
+        }
     }
+
+    static thread_local Executor* tl_owner;
+    static thread_local size_t tl_index;
+
+    const string m_name;
+    const size_t m_capacity;
+    vector<std::unique_ptr<WorkerQueue>> m_queues;
+    vector<thread> m_workers;
+
+    mutex m_mutex;                  // 搭配 m_workCv / m_spaceCv 使用
+    condition_variable m_workCv, m_spaceCv;
+    // 在 m_mutex 內寫入；submit 的快速路徑不持有鎖讀取，因此用 atomic
+    // (快速路徑取得名額後才停止也沒關係：worker 會等 m_queued 歸零才結束，這筆工作仍會執行)
+    std::atomic<bool> m_stop{false};
+
+    std::atomic<size_t> m_queued{0}, m_next{0}, m_active{0}, m_spaceWaiters{0};
+    std::atomic<uint64_t> m_submitted{0}, m_completed{0}, m_rejected{0}, m_steals{0};
+    std::atomic<uint64_t> m_waitUs{0}, m_runUs{0}, m_maxWaitUs{0};
+};
+
+thread_local Executor* Executor::tl_owner = nullptr;
+thread_local size_t Executor::tl_index = 0;
+
+// 全域 executor：執行緒數與佇列上限在 main() 啟動時決定 (BACKEND_WORKER_THREADS / WORKER_QUEUE_CAPACITY)
+shared_ptr<Executor> g_executor;
+
+// MySQL 錯誤代碼與訊息 (失敗時由寫入函式填入)
+struct DbError {
+    unsigned int code = 0;
+    string message;
 };
 
-// 全域執行緒池 (建議 4-8 個執行緒)
-ThreadPool g_threadPool(4);
+// 暫時性錯誤 (連線中斷、deadlock、lock wait timeout) 重試可能成功；
+// 其餘 (資料過長、違反限制...) 同一份資料重試結果都一樣。code = 0 (例如借不到連線) 視為暫時性
+// 錯誤碼 0 (未知) 與 statement 的 client 端錯誤 (例如 CR_PARAMS_NOT_BOUND) 視為永久性，重試不會成功
+bool isTransientDbError(unsigned int code) {
+    switch (code) {
+        case CR_CONNECTION_ERROR: case CR_CONN_HOST_ERROR: case CR_SERVER_GONE_ERROR: case CR_SERVER_LOST:
+        case CR_UNKNOWN_HOST: case CR_IPSOCK_ERROR: case CR_SERVER_HANDSHAKE_ERR:
+        case ER_CON_COUNT_ERROR: case ER_SERVER_SHUTDOWN: case ER_LOCK_WAIT_TIMEOUT: case ER_LOCK_DEADLOCK:
+        case ER_QUERY_INTERRUPTED:
+            return true;
+        default:
+            return false;
+    }
+}
 
-// --- MySQL 連線池 (保持不變) ---
+// --- MySQL 連線池 (min/max、公平等待佇列、背景維護) ---
 class DbPool {
     struct PooledConn {
         MYSQL* con;
-        std::chrono::steady_clock::time_point last_used;
+        std::chrono::steady_clock::time_point last_used;    // 最後一次歸還的時間 (用於縮減)
+        std::chrono::steady_clock::time_point last_checked; // 最後一次確認連線正常的時間 (用於 ping)
+    };
+    // 等待中的借用者；依到達順序排隊，歸還的連線直接交給排最前面的人
+    struct Waiter {
+        condition_variable cv;
+        MYSQL* con = nullptr;
     };
     string host, user, pass, db;
     int port;
-    queue<PooledConn> pool;
+    size_t minSize, maxSize;
+    std::deque<PooledConn> pool;    // 閒置連線，尾端是最近歸還的 (優先重用，前端自然老化後被縮減)
+    std::deque<Waiter*> waiters;
+    size_t total = 0;               // 已建立的連線數 (閒置 + 借出)
     mutex m_mutex;
+    condition_variable m_maintainCv;
+    bool m_stop = false;
+    thread m_maintainer;
+
+    uint64_t m_created = 0, m_closed = 0, m_timeouts = 0, m_waits = 0, m_lost = 0;
+    double m_waitMsTotal = 0;
+    // 每條連線最後一次確認正常 (建立 / ping 成功) 的時間；借出期間不會更新
+    unordered_map<MYSQL*, std::chrono::steady_clock::time_point> m_lastChecked;
+
+    // ✅ [效能優化] 每條連線各自的 prepared statement 快取 (依 SQL 文字，LRU)
+    // 連線同一時間只會借給一個人，所以快取內容不需上鎖；m_stmtCaches 本身的增刪由 m_mutex 保護
+    struct StmtCache {
+        std::list<pair<string, MYSQL_STMT*>> lru;   // 前端是最近使用
+        unordered_map<string, std::list<pair<string, MYSQL_STMT*>>::iterator> index;
+    };
+    unordered_map<MYSQL*, std::unique_ptr<StmtCache>> m_stmtCaches;
+    std::atomic<uint64_t> m_stmtHits{0}, m_stmtMisses{0}, m_stmtEvictions{0};
 
 public:
-    DbPool(string h, int p, string u, string pwd, string d) 
-        : host(h), port(p), user(u), pass(pwd), db(d) {
-        for (int i = 0; i < 10; ++i) {
+    DbPool(string h, int p, string u, string pwd, string d, size_t minConn = DB_POOL_MIN, size_t maxConn = DB_POOL_MAX) 
+        : host(h), user(u), pass(pwd), db(d), port(p), minSize(minConn), maxSize(std::max(minConn, maxConn)) {
+        auto now = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < minSize; ++i) {
             MYSQL* con = createConnection();
-            if (con) pool.push({con, std::chrono::steady_clock::now()});
+            if (con) {
+                pool.push_back({con, now, now});
+                m_lastChecked[con] = now;
+                total++;
+                m_created++;
+            }
         }
+        m_maintainer = thread([this] { maintainLoop(); });
     }
     ~DbPool() {
-        lock_guard<mutex> lock(m_mutex);
-        while(!pool.empty()) {
-            MYSQL* con = pool.front().con;
-            pool.pop();
-            mysql_close(con);
+        {
+            lock_guard<mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_maintainCv.notify_all();
+        if (m_maintainer.joinable()) m_maintainer.join();
+        std::deque<PooledConn> idle;
+        {
+            lock_guard<mutex> lock(m_mutex);
+            idle.swap(pool);
         }
+        for (auto& pc : idle) closeConnection(pc.con);
     }
     MYSQL* createConnection() {
         MYSQL* con = mysql_init(NULL);
@@ -153,45 +880,261 @@ public:
         }
         return con;
     }
+    // ✅ [效能優化] 借用連線不再建立連線或 ping (由背景 maintainer 負責)；
+    // 沒有閒置連線時排隊等待 (先到先得)，超過 DB_POOL_WAIT_MS 回傳 nullptr
     MYSQL* getConnection() {
-        PooledConn pConn;
-        bool needCreate = false;
-        
+        unique_lock<mutex> lock(m_mutex);
+        if (!pool.empty()) {
+            MYSQL* con = pool.back().con;
+            pool.pop_back();
+            lock.unlock();
+            g_metrics.observe("backend_db_pool_wait_seconds", "", 0.0);
+            return con;
+        }
+
+        Waiter w;
+        waiters.push_back(&w);
+        m_maintainCv.notify_one(); // 通知 maintainer 視情況補建連線
+        auto start = std::chrono::steady_clock::now();
+        w.cv.wait_until(lock, start + std::chrono::milliseconds(DB_POOL_WAIT_MS), [&] { return w.con != nullptr; });
+
+        double waited = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        m_waits++;
+        m_waitMsTotal += waited * 1000;
+        g_metrics.observe("backend_db_pool_wait_seconds", "", waited);
+        if (!w.con) {
+            waiters.erase(std::find(waiters.begin(), waiters.end(), &w));
+            m_timeouts++;
+            LOG_WARN("DB") << "Connection pool exhausted (" << total << "/" << maxSize << "), waited " << DB_POOL_WAIT_MS << "ms.";
+        }
+        return w.con;
+    }
+    // 歸還時若連線已中斷 (CR_SERVER_GONE_ERROR / CR_SERVER_LOST)，直接關閉不放回池中，由 maintainer 補建
+    void releaseConnection(MYSQL* con) {
+        if (!con) return;
+        unique_lock<mutex> lock(m_mutex);
+        if (!isConnectionLost(con)) {
+            handOff(con, m_lastChecked[con]);
+            return;
+        }
+        total--;
+        m_closed++;
+        m_lost++;
+        lock.unlock();
+        LOG_WARN("DB") << "Dropped lost connection: " << mysql_error(con);
+        closeConnection(con);
+        m_maintainCv.notify_one();
+    }
+
+    // 取得此連線上已 prepare 好的 statement；第一次使用才 prepare，之後直接重用 (省一次 round trip 與 server 端解析)
+    // statement 由連線池持有，呼叫端不可 mysql_stmt_close；連線被關閉 / 重建時自動失效
+    MYSQL_STMT* prepareCached(MYSQL* con, const string& sql) {
+        StmtCache* cache;
         {
-            // 鎖的範圍僅限於操作 queue
             lock_guard<mutex> lock(m_mutex);
-            if (pool.empty()) {
-                needCreate = true;
-            } else {
-                pConn = pool.front();
-                pool.pop();
-            }
+            auto& slot = m_stmtCaches[con];
+            if (!slot) slot = std::make_unique<StmtCache>();
+            cache = slot.get();
         }
 
-        // 在鎖外進行連線建立 (耗時操作)
-        if (needCreate) {
-            return createConnection();
+        auto it = cache->index.find(sql);
+        if (it != cache->index.end()) {
+            cache->lru.splice(cache->lru.begin(), cache->lru, it->second);
+            MYSQL_STMT* stmt = it->second->second;
+            mysql_stmt_free_result(stmt); // 清掉上一次未讀完的結果集
+            m_stmtHits++;
+            return stmt;
         }
 
-        // 在鎖外進行 Ping (耗時操作)
-        auto now = std::chrono::steady_clock::now();
-        if (std::chrono::duration_cast<std::chrono::seconds>(now - pConn.last_used).count() > 30) {
-            if (mysql_ping(pConn.con) != 0) {
-                mysql_close(pConn.con);
-                return createConnection();
-            }
+        m_stmtMisses++;
+        MYSQL_STMT* stmt = mysql_stmt_init(con);
+        if (!stmt) return nullptr;
+        if (mysql_stmt_prepare(stmt, sql.c_str(), sql.length()) != 0) {
+            LOG_ERROR("DB") << "Prepare failed: " << mysql_stmt_error(stmt);
+            mysql_stmt_close(stmt);
+            return nullptr;
         }
-        return pConn.con;
+        cache->lru.emplace_front(sql, stmt);
+        cache->index[sql] = cache->lru.begin();
+        if (cache->lru.size() > STMT_CACHE_PER_CONN) {
+            cache->index.erase(cache->lru.back().first);
+            mysql_stmt_close(cache->lru.back().second);
+            cache->lru.pop_back();
+            m_stmtEvictions++;
+        }
+        return stmt;
     }
-    void releaseConnection(MYSQL* con) {
-        if (!con) return;
+
+    json stats() {
         lock_guard<mutex> lock(m_mutex);
-        pool.push({con, std::chrono::steady_clock::now()});
+        size_t statements = 0;
+        for (auto& kv : m_stmtCaches) statements += kv.second->lru.size();
+        uint64_t hits = m_stmtHits.load(), misses = m_stmtMisses.load();
+        return json{{"total", total}, {"idle", pool.size()}, {"in_use", total - pool.size()},
+                    {"min", minSize}, {"max", maxSize}, {"waiters", waiters.size()},
+                    {"created", m_created}, {"closed", m_closed}, {"lost", m_lost}, {"wait_timeouts", m_timeouts},
+                    {"avg_wait_ms", m_waits ? m_waitMsTotal / m_waits : 0.0},
+                    {"stmt_cache", {{"statements", statements}, {"hits", hits}, {"misses", misses},
+                                    {"hit_ratio", hits + misses ? (double)hits / (hits + misses) : 0.0},
+                                    {"evictions", m_stmtEvictions.load()}}}};
+    }
+
+private:
+    static bool isLostError(unsigned int code) { return code == CR_SERVER_GONE_ERROR || code == CR_SERVER_LOST; }
+
+    // 呼叫前須持有 m_mutex：連線本身或它快取的 statement 最後一次操作是否因連線中斷而失敗
+    // (statement 的錯誤不一定會反映在 mysql_errno(con)；連線不會自動重連，中斷後的錯誤碼會一直保留)
+    bool isConnectionLost(MYSQL* con) {
+        if (isLostError(mysql_errno(con))) return true;
+        auto it = m_stmtCaches.find(con);
+        if (it == m_stmtCaches.end()) return false;
+        for (auto& kv : it->second->lru) {
+            if (isLostError(mysql_stmt_errno(kv.second))) return true;
+        }
+        return false;
+    }
+
+    // 關閉連線前先關掉它快取的 statement (呼叫時不可持有 m_mutex)
+    void closeConnection(MYSQL* con) {
+        std::unique_ptr<StmtCache> cache;
+        {
+            lock_guard<mutex> lock(m_mutex);
+            auto it = m_stmtCaches.find(con);
+            if (it != m_stmtCaches.end()) {
+                cache = std::move(it->second);
+                m_stmtCaches.erase(it);
+            }
+            m_lastChecked.erase(con);
+        }
+        if (cache) {
+            for (auto& kv : cache->lru) mysql_stmt_close(kv.second);
+        }
+        mysql_close(con);
+    }
+
+    // 呼叫前須持有 m_mutex：有人在等就直接交給最前面的人，否則放回閒置
+    void handOff(MYSQL* con, std::chrono::steady_clock::time_point checked) {
+        if (!waiters.empty()) {
+            Waiter* w = waiters.front();
+            waiters.pop_front();
+            w->con = con;
+            w->cv.notify_one();
+            return;
+        }
+        pool.push_back({con, std::chrono::steady_clock::now(), checked});
+    }
+
+    // 背景維護：補建連線給等待者 / 補足 min、ping 閒置過久的連線、把多餘的閒置連線縮減回 min
+    void maintainLoop() {
+        unique_lock<mutex> lock(m_mutex);
+        auto nextSweep = std::chrono::steady_clock::now();
+        auto growRetryAt = nextSweep; // 建立連線失敗後的退避時間
+        while (!m_stop) {
+            // 1. 有人在等、或低於 min 時補建連線 (在鎖外連線)
+            while (!m_stop && total < maxSize && (waiters.size() > 0 || total < minSize) &&
+                   std::chrono::steady_clock::now() >= growRetryAt) {
+                total++;
+                lock.unlock();
+                MYSQL* con = createConnection();
+                lock.lock();
+                if (!con) {
+                    total--;
+                    growRetryAt = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+                    LOG_WARN("DB") << "Failed to create connection, retry later.";
+                    break;
+                }
+                m_created++;
+                m_lastChecked[con] = std::chrono::steady_clock::now();
+                handOff(con, m_lastChecked[con]);
+            }
+
+            auto now = std::chrono::steady_clock::now();
+            if (now >= nextSweep) {
+                // 2. 縮減：閒置超過 DB_POOL_IDLE_SHRINK_SEC 的連線關閉到只剩 min (最舊的在前端)
+                vector<MYSQL*> toClose;
+                while (total > minSize && !pool.empty() &&
+                       now - pool.front().last_used > std::chrono::seconds(DB_POOL_IDLE_SHRINK_SEC)) {
+                    toClose.push_back(pool.front().con);
+                    pool.pop_front();
+                    total--;
+                    m_closed++;
+                }
+
+                // 3. 把太久沒確認的閒置連線暫時取出，在鎖外 ping
+                vector<PooledConn> toCheck;
+                for (auto it = pool.begin(); it != pool.end();) {
+                    if (now - it->last_checked > std::chrono::seconds(DB_POOL_IDLE_PING_SEC)) {
+                        toCheck.push_back(*it);
+                        it = pool.erase(it);
+                    } else {
+                        ++it;
+                    }
+                }
+
+                lock.unlock();
+                for (MYSQL* con : toClose) closeConnection(con);
+                vector<PooledConn> alive;
+                size_t dead = 0;
+                for (auto& pc : toCheck) {
+                    if (mysql_ping(pc.con) == 0) {
+                        pc.last_checked = std::chrono::steady_clock::now();
+                        alive.push_back(pc);
+                    } else {
+                        closeConnection(pc.con);
+                        dead++;
+                    }
+                }
+                lock.lock();
+                for (auto& pc : alive) m_lastChecked[pc.con] = pc.last_checked;
+
+                // 放回前端 (保持「較舊的在前」的順序)；有人在等就直接交出去
+                for (auto it = alive.rbegin(); it != alive.rend(); ++it) {
+                    if (!waiters.empty()) handOff(it->con, it->last_checked);
+                    else pool.push_front(*it);
+                }
+                if (dead > 0) {
+                    total -= dead;
+                    m_closed += dead;
+                    LOG_WARN("DB") << "Dropped " << dead << " dead connection(s).";
+                    continue; // 立刻補足 min
+                }
+                nextSweep = std::chrono::steady_clock::now() + std::chrono::milliseconds(DB_POOL_MAINTAIN_MS);
+            }
+
+            m_maintainCv.wait_until(lock, nextSweep, [&] {
+                return m_stop || (total < maxSize && waiters.size() > 0 && pool.empty() &&
+                                  std::chrono::steady_clock::now() >= growRetryAt);
+            });
+        }
     }
 };
 
 shared_ptr<DbPool> dbPool;
 
+// ✅ [可靠性] 借用連線的 RAII 包裝：離開 scope 時自動歸還，stoi / stoll 等丟出例外時也不會漏還連線。
+// 因例外離開時先 ROLLBACK，避免把交易進行中的連線交給下一個人；需要提早歸還時呼叫 release()
+class DbConnection {
+public:
+    DbConnection() : m_con(dbPool ? dbPool->getConnection() : nullptr), m_uncaught(std::uncaught_exceptions()) {}
+    ~DbConnection() {
+        if (m_con && std::uncaught_exceptions() > m_uncaught) mysql_query(m_con, "ROLLBACK");
+        release();
+    }
+    DbConnection(const DbConnection&) = delete;
+    DbConnection& operator=(const DbConnection&) = delete;
+
+    operator MYSQL*() const { return m_con; }
+
+    void release() {
+        if (m_con) dbPool->releaseConnection(m_con);
+        m_con = nullptr;
+    }
+
+private:
+    MYSQL* m_con;
+    int m_uncaught;
+};
+
 // --- Helper: SQL Escape ---
 string sql_escape(const string& str) {
     string out;
@@ -219,60 +1162,555 @@ string getCurrentDateTimeStr() {
     return string(buf);
 }
 
-// --- SOAP Client (優化版) ---
-class SoapClient {
+// --- 即時事件推播 (WebSocket) ---
+// ✅ [新增] 前端連到 /ws/events 後不再需要每秒輪詢 /heartbeat：
+// - 連線時先送出目前的 MES 狀態，之後斷路器狀態改變時主動推送 {"type":"mes_status",...}
+// - 送出 {"subscribe":["WO1","WO2"]} (或 "*" 代表全部) 後，該工單有新的掃描紀錄寫入 DB 時推送 {"type":"scan",...}
+class EventHub {
 public:
-    static string buildXml(int command, const string& emp_no, const string& message) {
-        return R"(<soapenv:Envelope xmlns:soapenv="http://schemas.xmlsoap.org/soap/envelope/" xmlns:tem="http://tempuri.org/"><soapenv:Header/><soapenv:Body><tem:UpLoadImage><tem:command>)" 
-               + to_string(command) + R"(</tem:command><tem:emp_no>)" + emp_no + R"(</tem:emp_no><tem:message>)" 
-               + message + R"(</tem:message><tem:image_byte>null</tem:image_byte><tem:result></tem:result></tem:UpLoadImage></soapenv:Body></soapenv:Envelope>)";
+    void add(crow::websocket::connection* conn) {
+        lock_guard<mutex> lock(m_mutex);
+        m_clients[conn];
     }
 
-    // ✅ [效能優化] 使用 thread_local 讓每個執行緒重用自己的連線 Session
-    static string sendRequest(int command, const string& emp_no, const string& message) {
-        // 1. 定義 thread_local 的 Session，只有第一次執行會初始化，之後會重複使用
-        static thread_local std::shared_ptr<cpr::Session> session;
-        
-        if (!session) {
-            session = std::make_shared<cpr::Session>();
-            session->SetUrl(cpr::Url{SOAP_URL});
-            // 設定 Keep-Alive 很重要
-            session->SetHeader(cpr::Header{
-                {"Content-Type", "text/xml;charset=utf-8"},
-                {"SOAPAction", SOAP_ACTION},
-                {"Connection", "keep-alive"} 
-            });
-            session->SetTimeout(cpr::Timeout{3000}); // 3秒超時
+    void remove(crow::websocket::connection* conn) {
+        lock_guard<mutex> lock(m_mutex);
+        m_clients.erase(conn);
+    }
+
+    // 用戶端訊息：{"subscribe":[...]} / {"unsubscribe":[...]}
+    void onMessage(crow::websocket::connection* conn, const string& data) {
+        json msg = json::parse(data, nullptr, false);
+        if (!msg.is_object()) return;
+        lock_guard<mutex> lock(m_mutex);
+        auto it = m_clients.find(conn);
+        if (it == m_clients.end()) return;
+        if (msg.contains("subscribe") && msg["subscribe"].is_array()) {
+            for (auto& wo : msg["subscribe"]) if (wo.is_string()) it->second.insert(wo.get<string>());
+        }
+        if (msg.contains("unsubscribe") && msg["unsubscribe"].is_array()) {
+            for (auto& wo : msg["unsubscribe"]) if (wo.is_string()) it->second.erase(wo.get<string>());
         }
+    }
 
-        // 2. 每次只更新 Body，不需要重新設定 URL 和 Header
-        session->SetBody(cpr::Body{buildXml(command, emp_no, message)});
+    static string mesStatusMessage(bool online, const char* state) {
+        return json{{"type", "mes_status"}, {"MES_alive", online}, {"state", state}, {"time", getCurrentDateTimeStr()}}.dump();
+    }
 
-        // 3. 發送請求
-        cpr::Response r = session->Post();
+    // 斷路器狀態改變時呼叫 (所有連線都會收到)
+    void publishMesStatus(bool online, const char* state) {
+        string text = mesStatusMessage(online, state);
+        lock_guard<mutex> lock(m_mutex);
+        for (auto& kv : m_clients) kv.first->send_text(text);
+        m_sent += m_clients.size();
+    }
+
+    // 掃描紀錄寫入 DB 後呼叫；依工單分組，只推給有訂閱的連線
+    void publishScans(const vector<ScannedData>& list) {
+        {
+            lock_guard<mutex> lock(m_mutex);
+            if (m_clients.empty()) return;
+        }
+        std::map<string, json> byWo;
+        for (const auto& s : list) {
+            json& items = byWo[s.workOrder];
+            if (items.is_null()) items = json::array();
+            items.push_back({{"sheet_no", s.sht_no}, {"panel_no", s.panel_no}, {"twodid_type", s.ret_type},
+                             {"twodid_status", s.status}, {"timestamp", s.timestamp}});
+        }
+
+        lock_guard<mutex> lock(m_mutex);
+        for (auto& kv : byWo) {
+            string text;
+            for (auto& client : m_clients) {
+                const auto& subs = client.second;
+                if (!subs.count(kv.first) && !subs.count("*")) continue;
+                if (text.empty()) text = json{{"type", "scan"}, {"workorder", kv.first}, {"scanned_data", kv.second}}.dump();
+                client.first->send_text(text);
+                m_sent++;
+            }
+        }
+    }
+
+    json stats() {
+        lock_guard<mutex> lock(m_mutex);
+        size_t subscriptions = 0;
+        for (auto& kv : m_clients) subscriptions += kv.second.size();
+        return json{{"connections", m_clients.size()}, {"subscriptions", subscriptions}, {"messages_sent", m_sent}};
+    }
+
+private:
+    mutex m_mutex;
+    unordered_map<crow::websocket::connection*, std::set<string>> m_clients; // 連線 -> 訂閱的工單
+    uint64_t m_sent = 0;
+};
+
+EventHub g_events;
+
+// --- MES 斷路器 (Circuit Breaker) ---
+// ✅ [可靠性] 取代原本的 g_isMesOnline：單次逾時不再讓整個服務切換為離線，
+// 依各 command 的滾動失敗率 / 慢呼叫率判斷是否跳脫；跳脫後冷卻 BREAKER_OPEN_MS，
+// 再以「實際流量」作為半開試探 (最多 BREAKER_HALF_OPEN_TRIALS 個)，全部成功才恢復。
+class MesCircuitBreaker {
+public:
+    enum class State { Closed, Open, HalfOpen };
+
+    struct Permit {
+        bool allowed = false;
+        bool trial = false;   // 半開狀態下的試探請求
+    };
+
+    Permit acquire() {
+        unique_lock<mutex> lock(m_mutex);
+        advance();
+        Permit p;
+        if (m_state == State::Closed) {
+            p = {true, false};
+        } else if (m_state == State::HalfOpen && m_trialsInFlight + m_trialSuccesses < BREAKER_HALF_OPEN_TRIALS) {
+            m_trialsInFlight++;
+            p = {true, true};
+        } else {
+            m_rejected++;
+        }
+        publishTransition(lock);
+        return p;
+    }
+
+    void record(int command, const Permit& permit, bool success, double latencyMs) {
+        unique_lock<mutex> lock(m_mutex);
+        recordLocked(command, permit, success, latencyMs);
+        publishTransition(lock);
+    }
+
+    // 開啟 (冷卻中) 才視為離線；半開時允許實際流量試探
+    bool isOnline() {
+        unique_lock<mutex> lock(m_mutex);
+        advance();
+        bool online = m_state != State::Open;
+        publishTransition(lock);
+        return online;
+    }
+
+    State state() {
+        unique_lock<mutex> lock(m_mutex);
+        advance();
+        State st = m_state;
+        publishTransition(lock);
+        return st;
+    }
+
+    static const char* stateName(State st) {
+        return st == State::Closed ? "closed" : (st == State::Open ? "open" : "half_open");
+    }
+
+    json stats() {
+        unique_lock<mutex> lock(m_mutex);
+        advance();
+        json cmds = json::object();
+        for (auto& kv : m_commands) {
+            const CommandStats& cs = kv.second;
+            cmds[to_string(kv.first)] = {{"calls", cs.totalCalls}, {"failures", cs.totalFailures}, {"slow_calls", cs.totalSlow},
+                                         {"window_failure_rate", cs.failureRate()}, {"window_slow_rate", cs.slowRate()},
+                                         {"avg_latency_ms", cs.ewmaLatency}, {"max_latency_ms", cs.windowMaxLatency()}};
+        }
+        json j{{"state", stateName(m_state)}, {"trips", m_trips}, {"rejected", m_rejected}, {"commands", cmds}};
+        publishTransition(lock);
+        return j;
+    }
+
+private:
+    // 呼叫前須持有 m_mutex
+    void recordLocked(int command, const Permit& permit, bool success, double latencyMs) {
+        CommandStats& cs = m_commands[command];
+        bool slow = latencyMs >= BREAKER_SLOW_CALL_MS;
+        cs.push(!success, slow, latencyMs);
+
+        if (permit.trial) {
+            m_trialsInFlight--;
+            if (m_state != State::HalfOpen) return;
+            if (!success) { trip("half-open trial failed (cmd " + to_string(command) + ")"); return; }
+            if (++m_trialSuccesses >= BREAKER_HALF_OPEN_TRIALS) {
+                m_state = State::Closed;
+                m_transitions++;
+                for (auto& kv : m_commands) kv.second.resetWindow();
+                LOG_INFO("MES") << "Circuit CLOSED. MES Server is Back Online!";
+            }
+            return;
+        }
+        if (m_state != State::Closed) return; // 跳脫前就送出的請求，結果不影響狀態
+
+        if (cs.consecutiveFailures >= BREAKER_CONSECUTIVE_FAILURES) {
+            trip(to_string(cs.consecutiveFailures) + " consecutive failures (cmd " + to_string(command) + ")");
+        } else if (cs.count >= BREAKER_MIN_CALLS && cs.failureRate() >= BREAKER_FAILURE_RATE) {
+            trip("failure rate " + to_string((int)(cs.failureRate() * 100)) + "% (cmd " + to_string(command) + ")");
+        } else if (cs.count >= BREAKER_MIN_CALLS && cs.slowRate() >= BREAKER_SLOW_CALL_RATE) {
+            trip("slow call rate " + to_string((int)(cs.slowRate() * 100)) + "% (cmd " + to_string(command) + ")");
+        }
+    }
+
+    // 狀態轉換只在 m_mutex 內記錄 (m_transitions)，放開鎖後才推播給 WebSocket client：
+    // 推播會逐一 send_text，不可放在每個 MES 呼叫都會經過的臨界區內，也避免 breaker -> EventHub 的上鎖順序。
+    // 每次轉換只由一個呼叫端推播；m_publishMutex 確保較舊的狀態不會在較新的之後送出
+    void publishTransition(unique_lock<mutex>& lock) {
+        if (m_transitions == m_claimedTransition) return;
+        uint64_t seq = m_claimedTransition = m_transitions;
+        State st = m_state;
+        lock.unlock();
+        lock_guard<mutex> pub(m_publishMutex);
+        if (seq <= m_publishedTransition) return;
+        m_publishedTransition = seq;
+        g_events.publishMesStatus(st != State::Open, stateName(st));
+    }
+
+    struct CommandStats {
+        bool failed[BREAKER_WINDOW_CALLS] = {};
+        bool slowCall[BREAKER_WINDOW_CALLS] = {};
+        double latency[BREAKER_WINDOW_CALLS] = {};
+        int next = 0, count = 0, consecutiveFailures = 0;
+        uint64_t totalCalls = 0, totalFailures = 0, totalSlow = 0;
+        double ewmaLatency = 0;
+
+        void push(bool fail, bool slow, double ms) {
+            failed[next] = fail; slowCall[next] = slow; latency[next] = ms;
+            next = (next + 1) % BREAKER_WINDOW_CALLS;
+            if (count < BREAKER_WINDOW_CALLS) count++;
+            consecutiveFailures = fail ? consecutiveFailures + 1 : 0;
+            totalCalls++;
+            if (fail) totalFailures++;
+            if (slow) totalSlow++;
+            ewmaLatency = (totalCalls == 1) ? ms : 0.8 * ewmaLatency + 0.2 * ms;
+        }
+        double failureRate() const {
+            int n = 0;
+            for (int i = 0; i < count; ++i) n += failed[i];
+            return count ? (double)n / count : 0.0;
+        }
+        double slowRate() const {
+            int n = 0;
+            for (int i = 0; i < count; ++i) n += slowCall[i];
+            return count ? (double)n / count : 0.0;
+        }
+        double windowMaxLatency() const {
+            double m = 0;
+            for (int i = 0; i < count; ++i) m = std::max(m, latency[i]);
+            return m;
+        }
+        void resetWindow() { next = 0; count = 0; consecutiveFailures = 0; }
+    };
+
+    // 冷卻時間到了就由 Open 轉為 HalfOpen
+    void advance() {
+        if (m_state == State::Open && std::chrono::steady_clock::now() >= m_openUntil) {
+            m_state = State::HalfOpen;
+            m_trialsInFlight = 0;
+            m_trialSuccesses = 0;
+            m_transitions++;
+            LOG_INFO("MES") << "Circuit HALF-OPEN. Probing with live traffic.";
+        }
+    }
+
+    void trip(const string& reason) {
+        m_state = State::Open;
+        m_openUntil = std::chrono::steady_clock::now() + std::chrono::milliseconds(BREAKER_OPEN_MS);
+        m_trips++;
+        m_transitions++;
+        LOG_WARN("MES") << "Circuit OPEN (" << reason << "). Switching to Offline Mode.";
+    }
+
+    mutex m_mutex;
+    uint64_t m_transitions = 0, m_claimedTransition = 0;   // m_mutex 保護
+    mutex m_publishMutex;                                  // 順序：不可在持有 m_mutex 時取得
+    uint64_t m_publishedTransition = 0;                    // m_publishMutex 保護
+    State m_state = State::Closed;
+    std::chrono::steady_clock::time_point m_openUntil{};
+    int m_trialsInFlight = 0, m_trialSuccesses = 0;
+    uint64_t m_trips = 0, m_rejected = 0;
+    std::map<int, CommandStats> m_commands;
+};
+
+MesCircuitBreaker g_mesBreaker;
+
+// --- SOAP Client (優化版) ---
+class SoapClient {
+public:
+    static string buildXml(int command, const string& emp_no, const string& message) {
+        return R"(<soapenv:Envelope xmlns:soapenv="http://schemas.xmlsoap.org/soap/envelope/" xmlns:tem="http://tempuri.org/"><soapenv:Header/><soapenv:Body><tem:UpLoadImage><tem:command>)" 
+               + to_string(command) + R"(</tem:command><tem:emp_no>)" + emp_no + R"(</tem:emp_no><tem:message>)" 
+               + message + R"(</tem:message><tem:image_byte>null</tem:image_byte><tem:result></tem:result></tem:UpLoadImage></soapenv:Body></soapenv:Envelope>)";
+    }
+
+    // ✅ [效能優化] 使用 thread_local 讓每個執行緒重用自己的連線 Session
+    // ✅ [可靠性] 經過斷路器：開啟時直接失敗不連線；delivered 表示是否收到 MES 的 HTTP 200 回應
+    static string sendRequest(int command, const string& emp_no, const string& message, bool* delivered = nullptr) {
+        if (delivered) *delivered = false;
+        MesCircuitBreaker::Permit permit = g_mesBreaker.acquire();
+        if (!permit.allowed) return "";
+
+        // 1. 定義 thread_local 的 Session，只有第一次執行會初始化，之後會重複使用
+        static thread_local std::shared_ptr<cpr::Session> session;
+        
+        if (!session) {
+            session = std::make_shared<cpr::Session>();
+            session->SetUrl(cpr::Url{SOAP_URL});
+            // 設定 Keep-Alive 很重要
+            session->SetHeader(cpr::Header{
+                {"Content-Type", "text/xml;charset=utf-8"},
+                {"SOAPAction", SOAP_ACTION},
+                {"Connection", "keep-alive"} 
+            });
+            session->SetTimeout(cpr::Timeout{3000}); // 3秒超時
+        }
+
+        // 2. 每次只更新 Body，不需要重新設定 URL 和 Header
+        session->SetBody(cpr::Body{buildXml(command, emp_no, message)});
+
+        // 3. 發送請求
+        auto start = std::chrono::steady_clock::now();
+        cpr::Response r = session->Post();
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
 
-        if (r.error.code != cpr::ErrorCode::OK || r.status_code != 200) {
+        bool ok = (r.error.code == cpr::ErrorCode::OK && r.status_code == 200);
+        g_mesBreaker.record(command, permit, ok, ms);
+        observeMesCall(command, ok, ms);
+        if (!ok) {
             // 如果連線失敗，我們可以考慮重置 session (視情況而定，這裡簡單處理)
             return ""; 
         }
+        if (delivered) *delivered = true;
+
+        return extractResult(r.text);
+    }
+
+    // MES 呼叫延遲 (/metrics)，同步 / 非同步 client 共用
+    static void observeMesCall(int command, bool ok, double ms) {
+        g_metrics.observe("backend_mes_request_duration_seconds",
+                          "command=\"" + to_string(command) + "\",result=\"" + (ok ? "ok" : "fail") + "\"", ms / 1000.0);
+    }
 
+    // 取出 <UpLoadImageResult> 的內容 (同步 / 非同步 client 共用)
+    static string extractResult(const string& body) {
         string target = "<UpLoadImageResult>";
         string end_target = "</UpLoadImageResult>";
-        size_t start_pos = r.text.find(target);
-        size_t end_pos = r.text.find(end_target);
+        size_t start_pos = body.find(target);
+        size_t end_pos = body.find(end_target);
         if (start_pos != string::npos && end_pos != string::npos) {
-            return r.text.substr(start_pos + target.length(), end_pos - start_pos - target.length());
+            return body.substr(start_pos + target.length(), end_pos - start_pos - target.length());
         }
         return "";
     }
+};
+
+// --- MES 非同步多工 Client (curl multi) ---
+// ✅ [效能優化] 給 /api/write2dids 使用：單一 event loop thread 以 curl multi 同時維持
+// MES_ASYNC_WINDOW 個進行中的請求，完成一個就補上一個 (滑動視窗)，不再受限於 thread pool 大小，
+// 也不用每 10 筆等最慢的那一筆。easy handle 與 keep-alive 連線由 multi handle 統一重用。
+class MesAsyncClient {
+public:
+    struct Result {
+        bool delivered = false;   // 是否收到 MES 的 HTTP 200 回應
+        string text;              // <UpLoadImageResult> 內容
+    };
+
+    explicit MesAsyncClient(size_t window) : m_window(window) {}
+    ~MesAsyncClient() { stop(); }
+
+    void start() {
+        if (m_running) return;
+        curl_global_init(CURL_GLOBAL_DEFAULT);
+        m_multi = curl_multi_init();
+        curl_multi_setopt(m_multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)m_window);
+        curl_multi_setopt(m_multi, CURLMOPT_MAXCONNECTS, (long)m_window);
+        m_headers = curl_slist_append(m_headers, "Content-Type: text/xml;charset=utf-8");
+        m_headers = curl_slist_append(m_headers, ("SOAPAction: " + SOAP_ACTION).c_str());
+        m_headers = curl_slist_append(m_headers, "Connection: keep-alive");
+        {
+            lock_guard<mutex> lock(m_mutex);
+            m_stop = false;
+            m_running = true;
+        }
+        m_thread = thread([this] { run(); });
+    }
+
+    // 送出前的請求會先全部完成才停止
+    void stop() {
+        if (!m_running) return;
+        {
+            lock_guard<mutex> lock(m_mutex);
+            m_stop = true;
+            curl_multi_wakeup(m_multi);
+        }
+        m_thread.join();
+        {
+            lock_guard<mutex> lock(m_mutex);
+            m_running = false;
+        }
+        for (CURL* h : m_idle) curl_easy_cleanup(h);
+        m_idle.clear();
+        curl_multi_cleanup(m_multi);
+        m_multi = nullptr;
+        curl_slist_free_all(m_headers);
+        m_headers = nullptr;
+    }
+
+    future<Result> submit(int command, const string& emp_no, const string& message) {
+        auto job = std::make_unique<Job>();
+        job->command = command;
+        job->body = SoapClient::buildXml(command, emp_no, message);
+        future<Result> f = job->done.get_future();
+
+        bool queued = false;
+        {
+            lock_guard<mutex> lock(m_mutex);
+            if (m_running && !m_stop) {
+                job->permit = g_mesBreaker.acquire();
+                if (job->permit.allowed) {
+                    m_pending.push_back(std::move(job));
+                    curl_multi_wakeup(m_multi); // 在鎖內喚醒，避免與 stop() 釋放 multi handle 競爭
+                    queued = true;
+                } else {
+                    // 斷路器開啟：立即回傳失敗，不佔用視窗
+                    m_rejected++;
+                    job->done.set_value(Result{});
+                    return f;
+                }
+            }
+        }
+        if (queued) return f;
+
+        // 尚未啟動 (或已停止) 時退回同步發送
+        Result r;
+        r.text = SoapClient::sendRequest(command, emp_no, message, &r.delivered);
+        job->done.set_value(r);
+        return f;
+    }
+
+    json stats() {
+        size_t pending;
+        {
+            lock_guard<mutex> lock(m_mutex);
+            pending = m_pending.size();
+        }
+        uint64_t done = m_completed.load();
+        return json{{"window", m_window}, {"in_flight", m_inFlight.load()}, {"pending", pending},
+                    {"completed", done}, {"failed", m_failed.load()}, {"rejected", m_rejected.load()},
+                    {"avg_latency_ms", done ? (double)m_totalLatencyMs.load() / done : 0.0}};
+    }
+
+private:
+    struct Job {
+        int command = 0;
+        string body;
+        string response;
+        MesCircuitBreaker::Permit permit;
+        promise<Result> done;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    static size_t onWrite(char* ptr, size_t size, size_t nmemb, void* userdata) {
+        static_cast<string*>(userdata)->append(ptr, size * nmemb);
+        return size * nmemb;
+    }
+
+    void attach(std::unique_ptr<Job> job) {
+        CURL* h;
+        if (m_idle.empty()) {
+            h = curl_easy_init();
+        } else {
+            h = m_idle.back();
+            m_idle.pop_back();
+        }
+        curl_easy_setopt(h, CURLOPT_URL, SOAP_URL.c_str());
+        curl_easy_setopt(h, CURLOPT_HTTPHEADER, m_headers);
+        curl_easy_setopt(h, CURLOPT_POSTFIELDS, job->body.c_str());
+        curl_easy_setopt(h, CURLOPT_POSTFIELDSIZE, (long)job->body.size());
+        curl_easy_setopt(h, CURLOPT_WRITEFUNCTION, &MesAsyncClient::onWrite);
+        curl_easy_setopt(h, CURLOPT_WRITEDATA, &job->response);
+        curl_easy_setopt(h, CURLOPT_TIMEOUT_MS, 3000L); // 與 SoapClient 相同的 3 秒超時
+        curl_easy_setopt(h, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(h, CURLOPT_TCP_KEEPALIVE, 1L);
+        job->start = std::chrono::steady_clock::now();
+        curl_multi_add_handle(m_multi, h);
+        m_jobs[h] = std::move(job);
+        m_inFlight++;
+    }
+
+    void finish(CURL* h, CURLcode code) {
+        auto it = m_jobs.find(h);
+        std::unique_ptr<Job> job = std::move(it->second);
+        m_jobs.erase(it);
+        curl_multi_remove_handle(m_multi, h);
+        m_idle.push_back(h);
+        m_inFlight--;
+
+        long status = 0;
+        curl_easy_getinfo(h, CURLINFO_RESPONSE_CODE, &status);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - job->start).count();
+        bool ok = (code == CURLE_OK && status == 200);
+        g_mesBreaker.record(job->command, job->permit, ok, ms);
+        SoapClient::observeMesCall(job->command, ok, ms);
+
+        m_completed++;
+        m_totalLatencyMs += (uint64_t)ms;
+        if (!ok) m_failed++;
+
+        Result r;
+        r.delivered = ok;
+        if (ok) r.text = SoapClient::extractResult(job->response);
+        job->done.set_value(std::move(r));
+    }
+
+    void run() {
+        while (true) {
+            vector<std::unique_ptr<Job>> ready;
+            {
+                lock_guard<mutex> lock(m_mutex);
+                if (m_stop && m_pending.empty() && m_jobs.empty()) break;
+                while (m_jobs.size() + ready.size() < m_window && !m_pending.empty()) {
+                    ready.push_back(std::move(m_pending.front()));
+                    m_pending.pop_front();
+                }
+            }
+            for (auto& job : ready) attach(std::move(job));
+
+            int running = 0;
+            curl_multi_perform(m_multi, &running);
+
+            int left = 0;
+            while (CURLMsg* msg = curl_multi_info_read(m_multi, &left)) {
+                if (msg->msg == CURLMSG_DONE) finish(msg->easy_handle, msg->data.result);
+            }
 
-    // Ping Server 也可以共用 Session (或者為了輕量化維持獨立 GET 也可以)
-    static bool pingServer() {
-        cpr::Response r = cpr::Get(cpr::Url{SOAP_URL}, cpr::Timeout{500});
-        return (r.status_code == 200);
+            // 有空位又有排隊的請求時不等待，其餘等 socket 事件或 submit 喚醒
+            bool more;
+            {
+                lock_guard<mutex> lock(m_mutex);
+                more = !m_pending.empty() && m_jobs.size() < m_window;
+            }
+            if (!more) curl_multi_poll(m_multi, nullptr, 0, 1000, nullptr);
+        }
     }
+
+    const size_t m_window;
+    CURLM* m_multi = nullptr;
+    curl_slist* m_headers = nullptr;
+    thread m_thread;
+
+    mutex m_mutex;                                   // 保護 m_pending / m_stop / m_running
+    std::deque<std::unique_ptr<Job>> m_pending;
+    bool m_stop = false;
+    bool m_running = false;
+
+    // 以下只由 event loop thread 存取
+    std::unordered_map<CURL*, std::unique_ptr<Job>> m_jobs;
+    vector<CURL*> m_idle;
+
+    std::atomic<size_t> m_inFlight{0};
+    std::atomic<uint64_t> m_completed{0}, m_failed{0}, m_rejected{0}, m_totalLatencyMs{0};
 };
 
+MesAsyncClient g_mesAsync(MES_ASYNC_WINDOW);
+
+
 // --- Parse SOAP Response (保持不變) ---
 WorkOrderData parseSoapResponse(string raw, string inputWO, int cmdType) {
     WorkOrderData data;
@@ -320,207 +1758,914 @@ WorkOrderData parseSoapResponse(string raw, string inputWO, int cmdType) {
     return data;
 }
 
-// --- DB Helper Functions (保持不變) ---
-// ✅ [安全修正] 改用 Prepared Statement (saveWorkOrderToDB)
-void saveWorkOrderToDB(const WorkOrderData& d) {
-    MYSQL* con = dbPool->getConnection();
-    if (!con) return;
-
-    // 1. 寫入 WorkOrder 主表
-    // 使用 ON DUPLICATE KEY UPDATE 語法
-    const char* query = "INSERT INTO 2DID_workorder (work_order, product_item, work_step, panel_sum, cmd236_flag) "
-                        "VALUES (?, ?, ?, ?, ?) "
-                        "ON DUPLICATE KEY UPDATE product_item=?, work_step=?, panel_sum=?";
-    
-    MYSQL_STMT* stmt = mysql_stmt_init(con);
-    if (stmt) {
-        if (mysql_stmt_prepare(stmt, query, strlen(query)) == 0) {
-            MYSQL_BIND bind[8];
-            memset(bind, 0, sizeof(bind));
-            
-            // 參數準備
-            unsigned long wo_len = d.workorder.length();
-            unsigned long item_len = d.item.length();
-            unsigned long step_len = d.workStep.length();
-            int cmd_flag = d.cmd236_flag ? 1 : 0;
-
-            // VALUES (?, ?, ?, ?, ?)
-            bind[0].buffer_type = MYSQL_TYPE_STRING; bind[0].buffer = (char*)d.workorder.c_str(); bind[0].length = &wo_len;
-            bind[1].buffer_type = MYSQL_TYPE_STRING; bind[1].buffer = (char*)d.item.c_str();      bind[1].length = &item_len;
-            bind[2].buffer_type = MYSQL_TYPE_STRING; bind[2].buffer = (char*)d.workStep.c_str();  bind[2].length = &step_len;
-            bind[3].buffer_type = MYSQL_TYPE_LONG;   bind[3].buffer = (char*)&d.panel_num;
-            bind[4].buffer_type = MYSQL_TYPE_LONG;   bind[4].buffer = (char*)&cmd_flag;
-            
-            // UPDATE product_item=?, work_step=?, panel_sum=?
-            bind[5].buffer_type = MYSQL_TYPE_STRING; bind[5].buffer = (char*)d.item.c_str();      bind[5].length = &item_len;
-            bind[6].buffer_type = MYSQL_TYPE_STRING; bind[6].buffer = (char*)d.workStep.c_str();  bind[6].length = &step_len;
-            bind[7].buffer_type = MYSQL_TYPE_LONG;   bind[7].buffer = (char*)&d.panel_num;
+// --- 串流 JSON 輸出 ---
+// ✅ [效能優化] 大工單不再先組 nlohmann::json 樹再 dump()：欄位直接由 WorkOrderData 寫進輸出字串，
+// 記憶體只剩最終的輸出內容，配置次數不隨 sheet 數量增加
+class JsonStreamWriter {
+public:
+    explicit JsonStreamWriter(string& out) : m_out(out) {}
+
+    JsonStreamWriter& beginObject() { sep(); m_out += '{'; m_comma = false; return *this; }
+    JsonStreamWriter& endObject()   { m_out += '}'; m_comma = true; return *this; }
+    JsonStreamWriter& beginArray()  { sep(); m_out += '['; m_comma = false; return *this; }
+    JsonStreamWriter& endArray()    { m_out += ']'; m_comma = true; return *this; }
+
+    JsonStreamWriter& key(const char* k) {
+        sep();
+        m_out += '"'; m_out += k; m_out += "\":"; // key 皆為程式內的常數，不需跳脫
+        m_comma = false;
+        return *this;
+    }
 
-            mysql_stmt_bind_param(stmt, bind);
-            mysql_stmt_execute(stmt);
+    JsonStreamWriter& value(const string& v) { sep(); writeString(v); m_comma = true; return *this; }
+    JsonStreamWriter& value(long long v) { sep(); m_out += std::to_string(v); m_comma = true; return *this; }
+    JsonStreamWriter& value(int v) { return value((long long)v); }
+    JsonStreamWriter& value(bool v) { sep(); m_out += (v ? "true" : "false"); m_comma = true; return *this; }
+    JsonStreamWriter& null() { sep(); m_out += "null"; m_comma = true; return *this; }
+    JsonStreamWriter& value(const vector<string>& list) {
+        beginArray();
+        for (const auto& v : list) value(v);
+        return endArray();
+    }
+    // 已序列化好的 JSON 片段直接附加 (例如小型的 json::dump())
+    JsonStreamWriter& raw(const string& fragment) { sep(); m_out += fragment; m_comma = true; return *this; }
+
+private:
+    void sep() { if (m_comma) m_out += ','; }
+
+    // 跳脫規則與 nlohmann::json::dump() 相同 (非 ASCII 原樣輸出)
+    void writeString(const string& v) {
+        static const char hex[] = "0123456789abcdef";
+        m_out += '"';
+        size_t start = 0;
+        for (size_t i = 0; i < v.size(); ++i) {
+            unsigned char c = (unsigned char)v[i];
+            if (c >= 0x20 && c != '"' && c != '\\') continue;
+            m_out.append(v, start, i - start);
+            start = i + 1;
+            switch (c) {
+                case '"':  m_out += "\\\""; break;
+                case '\\': m_out += "\\\\"; break;
+                case '\b': m_out += "\\b"; break;
+                case '\f': m_out += "\\f"; break;
+                case '\n': m_out += "\\n"; break;
+                case '\r': m_out += "\\r"; break;
+                case '\t': m_out += "\\t"; break;
+                default:
+                    m_out += "\\u00";
+                    m_out += hex[c >> 4];
+                    m_out += hex[c & 0xF];
+            }
         }
-        mysql_stmt_close(stmt);
+        m_out.append(v, start, string::npos);
+        m_out += '"';
     }
 
-    // 2. 刪除舊的預期產品資料
-    const char* delQuery = "DELETE FROM 2DID_expected_products WHERE work_order = ?";
-    stmt = mysql_stmt_init(con);
-    if (stmt) {
-        if (mysql_stmt_prepare(stmt, delQuery, strlen(delQuery)) == 0) {
-            MYSQL_BIND bind[1];
-            memset(bind, 0, sizeof(bind));
-            unsigned long wo_len = d.workorder.length();
-            bind[0].buffer_type = MYSQL_TYPE_STRING; bind[0].buffer = (char*)d.workorder.c_str(); bind[0].length = &wo_len;
-            mysql_stmt_bind_param(stmt, bind);
-            mysql_stmt_execute(stmt);
+    string& m_out;
+    bool m_comma = false;
+};
+
+// 工單 header + 預期清單的欄位 (不含外層大括號)，DB 與 MES 235/236 的回應共用
+void writeWorkOrderFields(JsonStreamWriter& w, const WorkOrderData& d) {
+    w.key("workorder").value(d.workorder);
+    w.key("item").value(d.item);
+    w.key("workStep").value(d.workStep);
+    w.key("panel_num").value(d.panel_num);
+    w.key("cmd236_flag").value(d.cmd236_flag);
+    w.key("sht_no").value(d.sht_no);
+    w.key("panel_no").value(d.panel_no);
+    w.key("twodid_step").value(d.twodid_step);
+    w.key("twodid_type").value(d.twodid_type);
+}
+
+// --- 工單快取 (Work Order Cache) ---
+// ✅ [效能優化] 以工單號為 key 的 LRU 快取，保存 header + 預期清單 + 每個 sheet 的最新掃描紀錄
+// - saveWorkOrderToDB / Delete_2DID 會使快取失效
+// - saveScannedListToDB commit 後以增量方式更新掃描區段，重複讀取不需再查 MySQL
+class WorkOrderCache {
+public:
+    struct Entry {
+        WorkOrderData data;                        // header + expected list
+        vector<ScannedData> scanned;               // 每個 sheet_no 只保留最新一筆，依 timestamp 由舊到新
+        unordered_map<string, size_t> sheetIndex;  // sheet_no -> scanned 索引
+        std::chrono::steady_clock::time_point loadedAt; // 由 DB 讀取的時間 (WO_CACHE_TTL_MS 判斷用)
+        mutex m;
+
+        void upsertScan(const ScannedData& s) {
+            auto it = sheetIndex.find(s.sht_no);
+            if (it != sheetIndex.end()) {
+                if (scanned[it->second].timestamp > s.timestamp) return; // 舊資料不覆蓋新資料
+                scanned.erase(scanned.begin() + it->second);
+                for (auto& kv : sheetIndex) if (kv.second > it->second) --kv.second;
+            }
+            // 依 timestamp 插入，維持與 DB 查詢相同的 ORDER BY timestamp ASC
+            auto pos = std::upper_bound(scanned.begin(), scanned.end(), s.timestamp,
+                [](long long ts, const ScannedData& x){ return ts < x.timestamp; });
+            size_t idx = pos - scanned.begin();
+            scanned.insert(pos, s);
+            for (auto& kv : sheetIndex) if (kv.second >= idx) ++kv.second;
+            sheetIndex[s.sht_no] = idx;
         }
-        mysql_stmt_close(stmt);
-    }
 
-    // 3. 批量寫入新的預期產品 (如果有)
-    if (!d.sht_no.empty()) {
-        mysql_query(con, "START TRANSACTION"); // 批量寫入開啟事務加速
-        
-        // 這裡為了保持代碼簡潔且高效，我們可以重複利用 stmt
-        // 或者因為是 Batch Insert，用 Prepared Statement 迴圈執行也是很快的
-        const char* insQuery = "INSERT INTO 2DID_expected_products (work_order, sheet_no, panel_no, twodid_step, twodid_type) VALUES (?, ?, ?, ?, ?)";
-        stmt = mysql_stmt_init(con);
-        if (stmt) {
-            if (mysql_stmt_prepare(stmt, insQuery, strlen(insQuery)) == 0) {
-                MYSQL_BIND bind[5];
-                memset(bind, 0, sizeof(bind));
-                
-                unsigned long wo_len = d.workorder.length();
-                char sht_buf[100], pnl_buf[100], step_buf[100], type_buf[20];
-                unsigned long sht_len, pnl_len, step_len, type_len;
-
-                bind[0].buffer_type = MYSQL_TYPE_STRING; bind[0].buffer = (char*)d.workorder.c_str(); bind[0].length = &wo_len;
-                bind[1].buffer_type = MYSQL_TYPE_STRING; bind[1].buffer = sht_buf; bind[1].length = &sht_len;
-                bind[2].buffer_type = MYSQL_TYPE_STRING; bind[2].buffer = pnl_buf; bind[2].length = &pnl_len;
-                bind[3].buffer_type = MYSQL_TYPE_STRING; bind[3].buffer = step_buf; bind[3].length = &step_len;
-                bind[4].buffer_type = MYSQL_TYPE_STRING; bind[4].buffer = type_buf; bind[4].length = &type_len;
-
-                mysql_stmt_bind_param(stmt, bind);
-
-                for (size_t i = 0; i < d.sht_no.size(); ++i) {
-                    strncpy(sht_buf, d.sht_no[i].c_str(), sizeof(sht_buf)); sht_len = d.sht_no[i].length();
-                    strncpy(pnl_buf, d.panel_no[i].c_str(), sizeof(pnl_buf)); pnl_len = d.panel_no[i].length();
-                    strncpy(step_buf, d.twodid_step[i].c_str(), sizeof(step_buf)); step_len = d.twodid_step[i].length();
-                    strncpy(type_buf, d.twodid_type[i].c_str(), sizeof(type_buf)); type_len = d.twodid_type[i].length();
-                    
-                    mysql_stmt_execute(stmt);
-                }
+        // 直接串流輸出 /api/workorder 的 data 物件，不建立中介 json
+        void writeJson(JsonStreamWriter& w) {
+            lock_guard<mutex> lock(m);
+            w.beginObject();
+            writeWorkOrderFields(w, data);
+            w.key("scanned_data").beginArray();
+            for (const auto& s : scanned) {
+                w.beginObject();
+                w.key("sheet_no").value(s.sht_no);
+                w.key("panel_no").value(s.panel_no);
+                w.key("twodid_type").value(s.ret_type);
+                w.key("twodid_status").value(s.status);
+                w.key("timestamp").value(s.timestamp);
+                w.endObject();
             }
-            mysql_stmt_close(stmt);
+            w.endArray();
+            w.endObject();
+        }
+    };
+
+    explicit WorkOrderCache(size_t capacity) : m_capacity(capacity) {}
+
+    shared_ptr<Entry> get(const string& wo) {
+        lock_guard<mutex> lock(m_mutex);
+        auto it = m_map.find(wo);
+        if (it == m_map.end()) { m_misses++; return nullptr; }
+        if (WO_CACHE_TTL_MS > 0 &&
+            std::chrono::steady_clock::now() - it->second.first->loadedAt > std::chrono::milliseconds(WO_CACHE_TTL_MS)) {
+            // 過期：重新查 DB，才能看到其他 instance 的寫入
+            m_lru.erase(it->second.second);
+            m_map.erase(it);
+            m_expired++;
+            m_misses++;
+            return nullptr;
         }
-        mysql_query(con, "COMMIT");
+        m_lru.splice(m_lru.begin(), m_lru, it->second.second);
+        m_hits++;
+        return it->second.first;
     }
 
-    dbPool->releaseConnection(con);
-}
+    // 查 DB 前先取得版本號；若讀取期間有失效或新掃描，put 會放棄寫入以免快取到舊資料
+    uint64_t beginLoad(const string& wo) {
+        lock_guard<mutex> lock(m_mutex);
+        auto it = m_versions.find(wo);
+        return (m_epoch << 32) | (it == m_versions.end() ? 0 : it->second);
+    }
 
-json readWorkOrderFromDB(string wo) {
-    MYSQL* con = dbPool->getConnection();
-    if (!con) return nullptr;
-    json result = nullptr;
-    // string sql = "SELECT * FROM 2DID_workorder WHERE work_order = '" + sql_escape(wo) + "'";
-    string sql = "SELECT work_order, product_item, work_step, panel_sum, cmd236_flag FROM 2DID_workorder WHERE work_order = '" + sql_escape(wo) + "'";
-    if (mysql_query(con, sql.c_str()) == 0) {
-        MYSQL_RES* res = mysql_store_result(con);
-        if (res) {
-            MYSQL_ROW row = mysql_fetch_row(res);
-            if (row) {
-                result["workorder"] = row[0] ? row[0] : "";
-                result["item"] = row[1] ? row[1] : "";
-                result["workStep"] = row[2] ? row[2] : "";
-                result["panel_num"] = row[3] ? stoi(row[3]) : 0;
-                result["cmd236_flag"] = (stoi(row[4]) == 1) ? true : false;
-                mysql_free_result(res); 
-
-                string detailSql = "SELECT sheet_no, panel_no, twodid_step, twodid_type FROM 2DID_expected_products WHERE work_order = '" + sql_escape(wo) + "'";
-                if (mysql_query(con, detailSql.c_str()) == 0) {
-                    MYSQL_RES* resDet = mysql_store_result(con);
-                    vector<string> sht, pnl, step, type;
-                    while ((row = mysql_fetch_row(resDet))) {
-                        sht.push_back(row[0] ? row[0] : "");
-                        pnl.push_back(row[1] ? row[1] : "");
-                        step.push_back(row[2] ? row[2] : "");
-                        type.push_back(row[3] ? row[3] : "");
-                    }
-                    result["sht_no"] = sht; result["panel_no"] = pnl;
-                    result["twodid_step"] = step; result["twodid_type"] = type;
-                    mysql_free_result(resDet);
-                }
+    void put(const string& wo, shared_ptr<Entry> e, uint64_t ticket) {
+        lock_guard<mutex> lock(m_mutex);
+        auto v = m_versions.find(wo);
+        if (ticket != ((m_epoch << 32) | (v == m_versions.end() ? 0 : v->second))) return;
+        e->loadedAt = std::chrono::steady_clock::now();
+        auto it = m_map.find(wo);
+        if (it != m_map.end()) {
+            it->second.first = e;
+            m_lru.splice(m_lru.begin(), m_lru, it->second.second);
+            return;
+        }
+        m_lru.push_front(wo);
+        m_map[wo] = {e, m_lru.begin()};
+        if (m_map.size() > m_capacity) {
+            m_map.erase(m_lru.back());
+            m_lru.pop_back();
+            m_evictions++;
+        }
+    }
 
-                string scanSql = "WITH Ranked AS ("
-                 "  SELECT sheet_no, panel_no, twodid_type, twodid_status, timestamp, "
-                 "         ROW_NUMBER() OVER (PARTITION BY sheet_no ORDER BY timestamp DESC) as rn "
-                 "  FROM 2DID_scanned_products "
-                 "  WHERE work_order = '" + sql_escape(wo) + "' "
-                 ") "
-                 "SELECT sheet_no, panel_no, twodid_type, twodid_status, timestamp "
-                 "FROM Ranked WHERE rn = 1 "
-                 "ORDER BY timestamp ASC";
-                json scannedData = json::array();
-                
-                if (mysql_query(con, scanSql.c_str()) == 0) {
-                    MYSQL_RES* resScan = mysql_store_result(con);
-                    while ((row = mysql_fetch_row(resScan))) {
-                        json item;
-                        item["sheet_no"] = row[0] ? row[0] : "";
-                        item["panel_no"] = row[1] ? row[1] : "";
-                        item["twodid_type"] = row[2] ? row[2] : "";
-                        item["twodid_status"] = row[3] ? row[3] : ""; 
-                        item["timestamp"] = row[4] ? std::stoll(row[4]) : 0;
-                        scannedData.push_back(item);
-                    }
-                    mysql_free_result(resScan);
-                }
-                result["scanned_data"] = scannedData;
-            } else {
-                mysql_free_result(res);
+    void invalidate(const string& wo) {
+        lock_guard<mutex> lock(m_mutex);
+        bumpVersion(wo);
+        auto it = m_map.find(wo);
+        if (it == m_map.end()) return;
+        m_lru.erase(it->second.second);
+        m_map.erase(it);
+        m_invalidations++;
+    }
+
+    // saveScannedListToDB commit 成功後呼叫：只更新已在快取中的工單
+    void applyScans(const vector<ScannedData>& list) {
+        vector<pair<shared_ptr<Entry>, const ScannedData*>> targets;
+        {
+            lock_guard<mutex> lock(m_mutex);
+            for (const auto& s : list) {
+                bumpVersion(s.workOrder);
+                auto it = m_map.find(s.workOrder);
+                if (it != m_map.end()) targets.push_back({it->second.first, &s});
             }
         }
+        for (auto& t : targets) {
+            lock_guard<mutex> lock(t.first->m);
+            t.first->upsertScan(*t.second);
+        }
     }
-    dbPool->releaseConnection(con);
-    return result;
-}
 
-// json readPlcCameraIPFromDB(string machine_id) {
-//     MYSQL* con = dbPool->getConnection();
-//     if (!con) return nullptr;
-    
-//     json result = nullptr;
-//     string sql = "SELECT machine_id, hub_ip, camera_ip, camera_role FROM 2did_machine_cameras WHERE machine_id = '" + sql_escape(machine_id) + "'";
+    json stats() {
+        lock_guard<mutex> lock(m_mutex);
+        uint64_t h = m_hits, m = m_misses;
+        return json{{"size", m_map.size()}, {"capacity", m_capacity}, {"hits", h}, {"misses", m},
+                    {"hit_ratio", (h + m) ? (double)h / (h + m) : 0.0},
+                    {"evictions", m_evictions.load()}, {"invalidations", m_invalidations.load()},
+                    {"expired", m_expired.load()}, {"ttl_ms", WO_CACHE_TTL_MS}};
+    }
 
-//     if (mysql_query(con, sql.c_str()) == 0) {
-//         MYSQL_RES* res = mysql_store_result(con);
-//         if (res) {
-//             MYSQL_ROW row;
-//             vector<string> left_cam_ip, right_cam_ip;
-//             bool found = false;
-            
-//             while ((row = mysql_fetch_row(res))) {
-//                 if (!found) {
-//                     result["machine_id"] = machine_id;
-//                     result["hub_ip"] = row[1] ? row[1] : "";
-//                     found = true;
-//                 }
+private:
+    void bumpVersion(const string& wo) {
+        // 版本表只是防止 race 用，過大時整批清空並換 epoch，讓進行中的 load 全部作廢
+        if (m_versions.size() > m_capacity * 16) { m_versions.clear(); m_epoch++; }
+        m_versions[wo]++;
+    }
 
-//                 string role = row[3] ? row[3] : "";
-//                 string ip = row[2] ? row[2] : "";
+    size_t m_capacity;
+    mutex m_mutex;
+    list<string> m_lru;
+    unordered_map<string, pair<shared_ptr<Entry>, list<string>::iterator>> m_map;
+    unordered_map<string, uint32_t> m_versions;
+    uint64_t m_epoch = 0;
+    atomic<uint64_t> m_hits{0}, m_misses{0}, m_evictions{0}, m_invalidations{0}, m_expired{0};
+};
 
-//                 if (role.find("LEFT") != string::npos) left_cam_ip.push_back(ip);
-//                 else if (role.find("RIGHT") != string::npos) right_cam_ip.push_back(ip);
-//             }
-//             if (found) {
-//                 result["cam"] = {{"left_cam_ip", left_cam_ip}, {"right_cam_ip", right_cam_ip}};
-//             }
-//             mysql_free_result(res);
-//         }
-//     }
+WorkOrderCache g_woCache(WO_CACHE_CAPACITY);
+
+// --- 批次寫入器 (Multi-row INSERT) ---
+// ✅ [效能優化] 將多筆資料打包成 INSERT ... VALUES (...),(...) 一次送出，
+// 取代逐筆 mysql_stmt_execute，大幅減少與 DB 之間的來回次數 (WAN 環境尤其明顯)
+struct BulkValue {
+    enum_field_types type;
+    string str;
+    long long num = 0;
+    BulkValue(const string& s) : type(MYSQL_TYPE_STRING), str(s) {}
+    BulkValue(const char* s) : type(MYSQL_TYPE_STRING), str(s ? s : "") {}
+    BulkValue(long long n) : type(MYSQL_TYPE_LONGLONG), num(n) {}
+    BulkValue(int n) : type(MYSQL_TYPE_LONGLONG), num(n) {}
+};
 
-//     string sql = "SELECT machine_id, plc_ip, plc_port, plc_type, addr_write_trigger, addr_write_result, metadata FROM 2did_machine_info WHERE machine_id = '" + sql_escape(machine_id) + "'";
+// 將 BulkValue 轉成 MYSQL_BIND (bind / lens 需與 values 同長度，且存活到 execute 之後)
+void bindValues(vector<BulkValue>& values, vector<MYSQL_BIND>& bind, vector<unsigned long>& lens) {
+    if (!bind.empty()) memset(bind.data(), 0, sizeof(MYSQL_BIND) * bind.size());
+    for (size_t i = 0; i < values.size(); ++i) {
+        BulkValue& v = values[i];
+        bind[i].buffer_type = v.type;
+        if (v.type == MYSQL_TYPE_STRING) {
+            lens[i] = v.str.length();
+            bind[i].buffer = (char*)v.str.c_str();
+            bind[i].length = &lens[i];
+        } else {
+            bind[i].buffer = (char*)&v.num;
+        }
+    }
+}
+
+class BulkInsertWriter {
+public:
+    // head: "INSERT INTO t (a, b, c)"，tail: 例如 " ON DUPLICATE KEY UPDATE ..." (可留空)
+    BulkInsertWriter(MYSQL* con, string head, size_t columns, string tail = "", size_t chunkRows = BULK_INSERT_CHUNK_ROWS)
+        : m_con(con), m_head(std::move(head)), m_tail(std::move(tail)), m_cols(columns) {
+        // MySQL 單一 statement 最多 65535 個 placeholder
+        m_chunkRows = std::max<size_t>(1, std::min(chunkRows, 65535 / m_cols));
+        m_values.reserve(m_chunkRows * m_cols);
+    }
+    BulkInsertWriter(const BulkInsertWriter&) = delete;
+    BulkInsertWriter& operator=(const BulkInsertWriter&) = delete;
+
+    bool add(std::initializer_list<BulkValue> row) {
+        if (m_failed) return false;
+        if (row.size() != m_cols) { m_failed = true; m_error = "column count mismatch"; return false; }
+        m_values.insert(m_values.end(), row.begin(), row.end());
+        if (m_values.size() >= m_chunkRows * m_cols) return flush();
+        return true;
+    }
+
+    bool flush() {
+        if (m_failed) return false;
+        size_t rows = m_values.size() / m_cols;
+        if (rows == 0) return true;
+
+        // 滿批 (與單列) 的 statement 由連線池依 SQL 文字快取，跨請求重複使用；
+        // 尾端不滿一批的列數每次都不同，若也快取會把每種列數各佔一格、擠掉常用的 statement，因此用完即關閉
+        bool cached = (rows == m_chunkRows || rows == 1);
+        MYSQL_STMT* stmt = prepare(rows, cached);
+        if (!stmt) return false;
+
+        vector<MYSQL_BIND> bind(m_values.size());
+        vector<unsigned long> lens(m_values.size());
+        bindValues(m_values, bind, lens);
+
+        bool ok = (mysql_stmt_bind_param(stmt, bind.data()) == 0) && (mysql_stmt_execute(stmt) == 0);
+        if (!ok) {
+            m_failed = true;
+            m_errno = mysql_stmt_errno(stmt);
+            m_error = mysql_stmt_error(stmt);
+            LOG_ERROR("DB") << "Bulk insert failed: " << m_error;
+        } else {
+            m_rowsWritten += rows;
+            m_chunks.push_back({mysql_stmt_insert_id(stmt), rows});
+        }
+        if (!cached) mysql_stmt_close(stmt);
+        m_values.clear();
+        return ok;
+    }
+
+    size_t rowsWritten() const { return m_rowsWritten; }
+    // 每個已送出的 statement：(第一筆 AUTO_INCREMENT id, 列數)，依 add 順序排列
+    // 單一多列 INSERT 取得的 id 為連續區段 (間隔為 auto_increment_increment)
+    const vector<pair<my_ulonglong, size_t>>& chunks() const { return m_chunks; }
+    bool failed() const { return m_failed; }
+    // 失敗的 statement 的錯誤碼 / 訊息 (statement 的錯誤不一定會反映在 mysql_errno(con))
+    unsigned int errorCode() const { return m_errno; }
+    const string& error() const { return m_error; }
+
+private:
+    MYSQL_STMT* prepare(size_t rows, bool cached) {
+        string group = "(";
+        for (size_t c = 0; c < m_cols; ++c) group += (c ? ", ?" : "?");
+        group += ")";
+        string sql;
+        sql.reserve(m_head.size() + m_tail.size() + rows * (group.size() + 1) + 8);
+        sql += m_head;
+        sql += " VALUES ";
+        for (size_t r = 0; r < rows; ++r) {
+            if (r) sql += ",";
+            sql += group;
+        }
+        sql += m_tail;
+
+        MYSQL_STMT* stmt = nullptr;
+        if (cached) {
+            stmt = dbPool->prepareCached(m_con, sql);
+        } else if ((stmt = mysql_stmt_init(m_con)) && mysql_stmt_prepare(stmt, sql.c_str(), sql.length()) != 0) {
+            LOG_ERROR("DB") << "Prepare failed: " << mysql_stmt_error(stmt);
+            m_errno = mysql_stmt_errno(stmt);
+            mysql_stmt_close(stmt);
+            stmt = nullptr;
+        }
+        if (!stmt) {
+            // prepare 失敗時 server 回傳的錯誤同時記在連線上
+            if (!m_errno) m_errno = mysql_errno(m_con);
+            m_failed = true;
+            m_error = "Bulk prepare failed";
+            return nullptr;
+        }
+        return stmt;
+    }
+
+    MYSQL* m_con;
+    string m_head, m_tail;
+    size_t m_cols, m_chunkRows;
+    vector<BulkValue> m_values;
+    vector<pair<my_ulonglong, size_t>> m_chunks;
+    size_t m_rowsWritten = 0;
+    bool m_failed = false;
+    unsigned int m_errno = 0;
+    string m_error;
+};
+
+// 執行單一 prepared statement (無結果集)，affected 可取得影響筆數
+bool execStmt(MYSQL* con, const char* sql, std::initializer_list<BulkValue> params, my_ulonglong* affected = nullptr) {
+    MYSQL_STMT* stmt = dbPool->prepareCached(con, sql);
+    if (!stmt) return false;
+    vector<BulkValue> values(params);
+    vector<MYSQL_BIND> bind(values.size());
+    vector<unsigned long> lens(values.size());
+    bindValues(values, bind, lens);
+    bool ok = (bind.empty() || mysql_stmt_bind_param(stmt, bind.data()) == 0)
+           && (mysql_stmt_execute(stmt) == 0);
+    if (!ok) LOG_ERROR("DB") << mysql_stmt_error(stmt);
+    else if (affected) *affected = mysql_stmt_affected_rows(stmt);
+    return ok;
+}
+
+// ✅ [新增] 執行有結果集的 prepared statement，每一列以字串交給 onRow (NULL 欄位為 nullptr)
+// ✅ [效能優化] 不做 mysql_stmt_store_result：逐列由網路讀取 (unbuffered)，client 端不會同時持有整份結果集。
+// 因此 onRow 內不可再使用同一條連線；超過預設緩衝的欄位以 mysql_stmt_fetch_column 補讀
+bool queryStmt(MYSQL* con, const string& sql, vector<BulkValue> values,
+               const function<void(const vector<const string*>&)>& onRow) {
+    MYSQL_STMT* stmt = dbPool->prepareCached(con, sql);
+    if (!stmt) return false;
+    vector<MYSQL_BIND> bind(values.size());
+    vector<unsigned long> lens(values.size());
+    bindValues(values, bind, lens);
+    if ((!bind.empty() && mysql_stmt_bind_param(stmt, bind.data()) != 0) || mysql_stmt_execute(stmt) != 0) {
+        LOG_ERROR("DB") << mysql_stmt_error(stmt);
+        return false;
+    }
+
+    // MySQL 8 的 is_null 是 bool*、MariaDB 是 my_bool*，依標頭實際型別配置
+    using NullFlag = std::remove_pointer<decltype(MYSQL_BIND::is_null)>::type;
+    size_t cols = mysql_stmt_field_count(stmt);
+    vector<MYSQL_BIND> out(cols);
+    vector<string> cells(cols, string(256, '\0'));
+    vector<unsigned long> outLens(cols, 0);
+    std::unique_ptr<NullFlag[]> nulls(new NullFlag[cols]()); // 不用 vector，避免 vector<bool> 特化
+    if (cols) memset(out.data(), 0, sizeof(MYSQL_BIND) * cols);
+    for (size_t i = 0; i < cols; ++i) {
+        out[i].buffer_type = MYSQL_TYPE_STRING;
+        out[i].buffer = &cells[i][0];
+        out[i].buffer_length = cells[i].size();
+        out[i].length = &outLens[i];
+        out[i].is_null = &nulls[i];
+    }
+    if (cols && mysql_stmt_bind_result(stmt, out.data()) != 0) {
+        LOG_ERROR("DB") << mysql_stmt_error(stmt);
+        mysql_stmt_reset(stmt);
+        return false;
+    }
+
+    bool ok = true;
+    vector<string> row(cols);
+    vector<const string*> ptrs(cols);
+    while (true) {
+        int rc = mysql_stmt_fetch(stmt);
+        if (rc == MYSQL_NO_DATA) break;
+        if (rc != 0 && rc != MYSQL_DATA_TRUNCATED) {
+            LOG_ERROR("DB") << mysql_stmt_error(stmt);
+            mysql_stmt_reset(stmt); // 丟棄尚未讀取的列，連線才能再使用
+            ok = false;
+            break;
+        }
+        for (size_t i = 0; i < cols; ++i) {
+            if (nulls[i]) { ptrs[i] = nullptr; continue; }
+            if (outLens[i] > cells[i].size()) {
+                // 欄位被截斷：以實際長度補讀這一欄
+                row[i].assign(outLens[i], '\0');
+                MYSQL_BIND col;
+                memset(&col, 0, sizeof(col));
+                col.buffer_type = MYSQL_TYPE_STRING;
+                col.buffer = &row[i][0];
+                col.buffer_length = outLens[i];
+                mysql_stmt_fetch_column(stmt, &col, (unsigned int)i, 0);
+            } else {
+                row[i].assign(cells[i].data(), outLens[i]);
+            }
+            ptrs[i] = &row[i];
+        }
+        try {
+            onRow(ptrs);
+        } catch (...) {
+            mysql_stmt_reset(stmt); // onRow 丟出例外 (例如 stoll)：丟棄剩餘的列，連線歸還後仍可使用
+            throw;
+        }
+    }
+    mysql_stmt_free_result(stmt);
+    return ok;
+}
+
+// --- DB Helper Functions (保持不變) ---
+// ✅ [安全修正] 改用 Prepared Statement (saveWorkOrderToDB)
+void saveWorkOrderToDB(const WorkOrderData& d) {
+    DbConnection con;
+    if (!con) return;
+
+    // 1. 寫入 WorkOrder 主表
+    // 使用 ON DUPLICATE KEY UPDATE 語法
+    const char* query = "INSERT INTO 2DID_workorder (work_order, product_item, work_step, panel_sum, cmd236_flag) "
+                        "VALUES (?, ?, ?, ?, ?) "
+                        "ON DUPLICATE KEY UPDATE product_item=?, work_step=?, panel_sum=?";
+    
+    bool headerChanged = true;
+    // ✅ [效能優化] statement 由連線池快取，不需每次 prepare / close
+    MYSQL_STMT* stmt = dbPool->prepareCached(con, query);
+    if (stmt) {
+        MYSQL_BIND bind[8];
+        memset(bind, 0, sizeof(bind));
+        
+        // 參數準備
+        unsigned long wo_len = d.workorder.length();
+        unsigned long item_len = d.item.length();
+        unsigned long step_len = d.workStep.length();
+        int cmd_flag = d.cmd236_flag ? 1 : 0;
+
+        // VALUES (?, ?, ?, ?, ?)
+        bind[0].buffer_type = MYSQL_TYPE_STRING; bind[0].buffer = (char*)d.workorder.c_str(); bind[0].length = &wo_len;
+        bind[1].buffer_type = MYSQL_TYPE_STRING; bind[1].buffer = (char*)d.item.c_str();      bind[1].length = &item_len;
+        bind[2].buffer_type = MYSQL_TYPE_STRING; bind[2].buffer = (char*)d.workStep.c_str();  bind[2].length = &step_len;
+        bind[3].buffer_type = MYSQL_TYPE_LONG;   bind[3].buffer = (char*)&d.panel_num;
+        bind[4].buffer_type = MYSQL_TYPE_LONG;   bind[4].buffer = (char*)&cmd_flag;
+        
+        // UPDATE product_item=?, work_step=?, panel_sum=?
+        bind[5].buffer_type = MYSQL_TYPE_STRING; bind[5].buffer = (char*)d.item.c_str();      bind[5].length = &item_len;
+        bind[6].buffer_type = MYSQL_TYPE_STRING; bind[6].buffer = (char*)d.workStep.c_str();  bind[6].length = &step_len;
+        bind[7].buffer_type = MYSQL_TYPE_LONG;   bind[7].buffer = (char*)&d.panel_num;
+
+        mysql_stmt_bind_param(stmt, bind);
+        // ON DUPLICATE KEY UPDATE 內容完全相同時 affected rows 為 0
+        if (mysql_stmt_execute(stmt) == 0) headerChanged = (mysql_stmt_affected_rows(stmt) != 0);
+    }
+
+    // ✅ [效能優化] 2. 與 DB 現有的預期清單比對，只寫入差異 (新增 / 更新 / 刪除)
+    // MES 重複回傳相同清單時完全不會寫入，減少 binlog 與鎖定時間
+    // key = sheet_no + panel_no；任一邊有重複 key 或差異過多時退回「全部刪除 + 重寫」
+    mysql_query(con, "START TRANSACTION");
+
+    struct Row { string step, type; };
+    auto makeKey = [](const string& sht, const string& pnl) { return sht + '\x1f' + pnl; };
+    unordered_map<string, Row> stored;
+    bool fullRewrite = false;
+
+    string selSql = "SELECT sheet_no, panel_no, twodid_step, twodid_type FROM 2DID_expected_products WHERE work_order = '" + sql_escape(d.workorder) + "' FOR UPDATE";
+    if (mysql_query(con, selSql.c_str()) == 0) {
+        MYSQL_RES* res = mysql_store_result(con);
+        if (res) {
+            MYSQL_ROW row;
+            while ((row = mysql_fetch_row(res))) {
+                string key = makeKey(row[0] ? row[0] : "", row[1] ? row[1] : "");
+                if (!stored.emplace(key, Row{row[2] ? row[2] : "", row[3] ? row[3] : ""}).second) fullRewrite = true;
+            }
+            mysql_free_result(res);
+        }
+    } else {
+        fullRewrite = true;
+    }
+
+    vector<size_t> toInsert, toUpdate;
+    vector<pair<string, string>> toDelete;
+    if (!fullRewrite) {
+        unordered_map<string, bool> seen;
+        seen.reserve(d.sht_no.size());
+        for (size_t i = 0; i < d.sht_no.size(); ++i) {
+            string key = makeKey(d.sht_no[i], d.panel_no[i]);
+            if (!seen.emplace(key, true).second) { fullRewrite = true; break; }
+            auto it = stored.find(key);
+            if (it == stored.end()) toInsert.push_back(i);
+            else if (it->second.step != d.twodid_step[i] || it->second.type != d.twodid_type[i]) toUpdate.push_back(i);
+        }
+        if (!fullRewrite) {
+            for (const auto& kv : stored) {
+                if (seen.count(kv.first)) continue;
+                size_t sep = kv.first.find('\x1f');
+                toDelete.push_back({kv.first.substr(0, sep), kv.first.substr(sep + 1)});
+            }
+        }
+        // UPDATE / DELETE 是逐筆執行，差異超過一半時直接整批重寫比較快
+        if (toUpdate.size() + toDelete.size() > d.sht_no.size() / 2 + 16) fullRewrite = true;
+    }
+
+    // 逐筆執行 prepared statement 的小工具 (UPDATE / DELETE 共用)
+    auto execEach = [&](const char* q, size_t count, const function<vector<const string*>(size_t)>& params) -> bool {
+        if (count == 0) return true;
+        MYSQL_STMT* st = dbPool->prepareCached(con, q);
+        if (!st) return false;
+        bool ok = true;
+        for (size_t n = 0; ok && n < count; ++n) {
+            vector<const string*> p = params(n);
+            vector<MYSQL_BIND> bind(p.size());
+            vector<unsigned long> lens(p.size());
+            memset(bind.data(), 0, sizeof(MYSQL_BIND) * bind.size());
+            for (size_t k = 0; k < p.size(); ++k) {
+                lens[k] = p[k]->length();
+                bind[k].buffer_type = MYSQL_TYPE_STRING; bind[k].buffer = (char*)p[k]->c_str(); bind[k].length = &lens[k];
+            }
+            ok = (mysql_stmt_bind_param(st, bind.data()) == 0) && (mysql_stmt_execute(st) == 0);
+        }
+        if (!ok) LOG_ERROR("DB") << "Expected products diff failed: " << mysql_stmt_error(st);
+        return ok;
+    };
+
+    bool ok = true;
+    size_t changed = 0;
+    if (fullRewrite) {
+        ok = execEach("DELETE FROM 2DID_expected_products WHERE work_order = ?", 1,
+                      [&](size_t) { return vector<const string*>{&d.workorder}; });
+        toInsert.clear();
+        for (size_t i = 0; i < d.sht_no.size(); ++i) toInsert.push_back(i);
+        changed = stored.size() + d.sht_no.size();
+    } else {
+        ok = execEach("DELETE FROM 2DID_expected_products WHERE work_order = ? AND sheet_no = ? AND panel_no = ?", toDelete.size(),
+                      [&](size_t n) { return vector<const string*>{&d.workorder, &toDelete[n].first, &toDelete[n].second}; })
+          && execEach("UPDATE 2DID_expected_products SET twodid_step = ?, twodid_type = ? WHERE work_order = ? AND sheet_no = ? AND panel_no = ?", toUpdate.size(),
+                      [&](size_t n) { size_t i = toUpdate[n]; return vector<const string*>{&d.twodid_step[i], &d.twodid_type[i], &d.workorder, &d.sht_no[i], &d.panel_no[i]}; });
+        changed = toInsert.size() + toUpdate.size() + toDelete.size();
+    }
+
+    // 3. 批量寫入新增的預期產品
+    // ✅ [效能優化] 多列 INSERT，每 BULK_INSERT_CHUNK_ROWS 筆才一次來回
+    if (ok && !toInsert.empty()) {
+        BulkInsertWriter writer(con, "INSERT INTO 2DID_expected_products (work_order, sheet_no, panel_no, twodid_step, twodid_type)", 5);
+        for (size_t i : toInsert) {
+            if (!writer.add({d.workorder, d.sht_no[i], d.panel_no[i], d.twodid_step[i], d.twodid_type[i]})) break;
+        }
+        ok = writer.flush();
+    }
+    mysql_query(con, ok ? "COMMIT" : "ROLLBACK");
+
+    con.release();
+
+    // 清單與 header 都沒有變動時保留快取
+    if (changed > 0 || headerChanged || !ok) g_woCache.invalidate(d.workorder);
+}
+
+shared_ptr<WorkOrderCache::Entry> readWorkOrderFromDB(const string& wo) {
+    // 1. 先查快取
+    if (auto cached = g_woCache.get(wo)) return cached;
+
+    uint64_t ticket = g_woCache.beginLoad(wo);
+    DbConnection con;
+    if (!con) return nullptr;
+    shared_ptr<WorkOrderCache::Entry> entry = make_shared<WorkOrderCache::Entry>();
+    WorkOrderData& d = entry->data;
+
+    // ✅ [效能優化] header / 預期清單 / 最新掃描以一個 UNION ALL prepared statement 一次取回 (單一來回)，
+    // 第一欄為資料種類；最新掃描改讀 2DID_latest_scans，不再對整份掃描歷史做 ROW_NUMBER() 視窗運算
+    static const char* sql =
+        "SELECT 'H', work_order, product_item, work_step, CAST(panel_sum AS CHAR), CAST(cmd236_flag AS CHAR) "
+        "  FROM 2DID_workorder WHERE work_order = ? "
+        "UNION ALL "
+        "SELECT 'E', sheet_no, panel_no, twodid_step, twodid_type, NULL "
+        "  FROM 2DID_expected_products WHERE work_order = ? "
+        "UNION ALL "
+        "SELECT 'S', sheet_no, panel_no, twodid_type, twodid_status, CAST(timestamp AS CHAR) "
+        "  FROM 2DID_latest_scans WHERE work_order = ?";
+    auto str = [](const string* v) { return v ? *v : string(); };
+    bool ok = queryStmt(con, sql, {wo, wo, wo}, [&](const vector<const string*>& row) {
+        const string kind = str(row[0]);
+        if (kind == "H") {
+            d.workorder = str(row[1]);
+            d.item = str(row[2]);
+            d.workStep = str(row[3]);
+            d.panel_num = row[4] ? stoi(*row[4]) : 0;
+            d.cmd236_flag = row[5] && stoi(*row[5]) == 1;
+            d.valid = true;
+        } else if (kind == "E") {
+            d.sht_no.push_back(str(row[1]));
+            d.panel_no.push_back(str(row[2]));
+            d.twodid_step.push_back(str(row[3]));
+            d.twodid_type.push_back(str(row[4]));
+        } else {
+            ScannedData s;
+            s.workOrder = wo;
+            s.sht_no = str(row[1]);
+            s.panel_no = str(row[2]);
+            s.ret_type = str(row[3]);
+            s.status = str(row[4]);
+            s.timestamp = row[5] ? std::stoll(*row[5]) : 0;
+            entry->scanned.push_back(std::move(s));
+        }
+    });
+    con.release();
+
+    // 查無資料不快取 (之後可能由 API 235/236 寫入)
+    if (!ok || !d.valid) return nullptr;
+
+    // 掃描依時間先後排列 (同原本 ORDER BY timestamp ASC)，再建立 sheet 索引
+    std::stable_sort(entry->scanned.begin(), entry->scanned.end(),
+                     [](const ScannedData& a, const ScannedData& b) { return a.timestamp < b.timestamp; });
+    for (size_t i = 0; i < entry->scanned.size(); ++i) entry->sheetIndex[entry->scanned[i].sht_no] = i;
+    g_woCache.put(wo, entry, ticket);
+    return entry;
+}
+
+// --- Single-Flight ---
+// ✅ [效能優化] 同一個 key 同時只執行一次：第一個呼叫者負責執行，其餘的等待並共用同一份結果 (或例外)
+template<class T>
+class SingleFlight {
+public:
+    T run(const string& key, const function<T()>& fn) {
+        shared_ptr<Call> call;
+        bool leader = false;
+        {
+            lock_guard<mutex> lock(m_mutex);
+            m_calls++;
+            auto it = m_inflight.find(key);
+            if (it != m_inflight.end()) {
+                call = it->second;
+                m_shared++;
+            } else {
+                call = make_shared<Call>();
+                call->result = call->done.get_future().share();
+                m_inflight[key] = call;
+                leader = true;
+            }
+        }
+        if (!leader) return call->result.get();
+
+        try {
+            call->done.set_value(fn());
+        } catch (...) {
+            call->done.set_exception(std::current_exception());
+        }
+        {
+            lock_guard<mutex> lock(m_mutex);
+            m_inflight.erase(key);
+        }
+        return call->result.get();
+    }
+
+    json stats() {
+        lock_guard<mutex> lock(m_mutex);
+        return json{{"calls", m_calls}, {"shared", m_shared}, {"in_flight", m_inflight.size()}};
+    }
+
+private:
+    struct Call {
+        promise<T> done;
+        std::shared_future<T> result;
+    };
+    mutex m_mutex;
+    unordered_map<string, shared_ptr<Call>> m_inflight;
+    uint64_t m_calls = 0, m_shared = 0;
+};
+
+SingleFlight<shared_ptr<string>> g_woLookupFlight;  // 共用結果的呼叫端只可讀取
+
+// --- TTL 快取 ---
+// 短時間內可接受舊值的查詢結果 (例如 COUNT(*))，過期的項目在下次 get 時視為不存在
+template<class V>
+class TtlCache {
+public:
+    TtlCache(size_t capacity, int ttlMs) : m_capacity(capacity), m_ttl(std::chrono::milliseconds(ttlMs)) {}
+
+    bool get(const string& key, V& out) {
+        lock_guard<mutex> lock(m_mutex);
+        auto it = m_map.find(key);
+        if (it == m_map.end() || std::chrono::steady_clock::now() - it->second.second > m_ttl) {
+            m_misses++;
+            return false;
+        }
+        m_hits++;
+        out = it->second.first;
+        return true;
+    }
+
+    void put(const string& key, V value) {
+        lock_guard<mutex> lock(m_mutex);
+        auto now = std::chrono::steady_clock::now();
+        if (m_map.size() >= m_capacity && !m_map.count(key)) {
+            // 先清掉過期的，仍然滿就整個清空 (key 數量有限，不值得維護 LRU)
+            for (auto it = m_map.begin(); it != m_map.end();) {
+                if (now - it->second.second > m_ttl) it = m_map.erase(it); else ++it;
+            }
+            if (m_map.size() >= m_capacity) m_map.clear();
+        }
+        m_map[key] = {std::move(value), now};
+    }
+
+    json stats() {
+        lock_guard<mutex> lock(m_mutex);
+        return json{{"size", m_map.size()}, {"capacity", m_capacity}, {"hits", m_hits}, {"misses", m_misses},
+                    {"ttl_ms", std::chrono::duration_cast<std::chrono::milliseconds>(m_ttl).count()}};
+    }
+
+private:
+    size_t m_capacity;
+    std::chrono::steady_clock::duration m_ttl;
+    mutex m_mutex;
+    unordered_map<string, pair<V, std::chrono::steady_clock::time_point>> m_map;
+    uint64_t m_hits = 0, m_misses = 0;
+};
+
+TtlCache<long long> g_pcsCountCache(PCS_COUNT_CACHE_CAPACITY, PCS_COUNT_CACHE_TTL_MS);
+
+// 235 / 236 預先並行查詢的統計 (wasted = 235 已有結果，236 白送)
+struct WorkOrderSpeculation {
+    bool enabled = false;
+    std::atomic<uint64_t> lookups{0}, used{0}, wasted{0}, rejected{0};
+
+    json stats() const {
+        uint64_t u = used.load(), w = wasted.load();
+        return json{{"enabled", enabled}, {"lookups", lookups.load()}, {"used_236", u}, {"wasted_236", w},
+                    {"executor_rejected", rejected.load()}, {"waste_ratio", u + w ? (double)w / (u + w) : 0.0}};
+    }
+} g_woSpeculation;
+
+// /api/workorder 成功時的回應：{"success":true,"source":...,"data":{...}}，data 由 writeData 串流寫入
+// 直接寫進最後交給 crow::response 的字串 (依上一次的大小預留容量)，途中不再複製
+shared_ptr<string> workOrderResponse(const char* source, const function<void(JsonStreamWriter&)>& writeData) {
+    thread_local size_t lastSize = 0;
+    auto body = make_shared<string>();
+    body->reserve(std::min(lastSize, JSON_BUFFER_KEEP_BYTES));
+    JsonStreamWriter w(*body);
+    w.beginObject();
+    w.key("success").value(true);
+    w.key("source").value(string(source));
+    w.key("data");
+    writeData(w);
+    w.endObject();
+    lastSize = body->size();
+    return body;
+}
+
+// MES 235/236 查得的工單 (尚無掃描紀錄)
+shared_ptr<string> workOrderResponse(const char* source, const WorkOrderData& d) {
+    return workOrderResponse(source, [&](JsonStreamWriter& w) {
+        w.beginObject();
+        writeWorkOrderFields(w, d);
+        w.key("scanned_data").null();
+        w.endObject();
+    });
+}
+
+shared_ptr<string> jsonResponse(const json& j) {
+    return make_shared<string>(j.dump());
+}
+
+// 工單查詢：快取 / DB -> MES 235 -> MES 236，回傳 /api/workorder 已序列化的回應內容
+// 同一工單的同時查詢由 g_woLookupFlight 合併，MES 與 DB 只會看到一次請求
+shared_ptr<string> lookupWorkOrder(const string& wo, const string& emp, bool insertDB) {
+    // 1. 先查本地 DB
+    if (auto entry = readWorkOrderFromDB(wo)) {
+        return workOrderResponse("DB", [&](JsonStreamWriter& w) { entry->writeJson(w); });
+    }
+
+    // 2. 檢查連線狀態 (Fast Fail)
+    // [Req 4] 若已知斷線，直接回傳錯誤，不讓前端空等
+    if (!g_mesBreaker.isOnline()) {
+        return jsonResponse(json{{"success", false}, {"type", "mes_offline"}, {"message", "因與 IT server 網路中斷，因此工單查詢失敗"}});
+    }
+
+    // ✅ [效能優化] 預先並行模式：235 在目前執行緒送出的同時，236 交給 executor 送出，
+    // 舊工單不必再等兩次 MES 往返；235 有效時 236 的結果直接捨棄 (計入 wasted)
+    struct Res236 { string raw; bool delivered = false; };
+    future<Res236> spec236;
+    bool speculating = false;
+    if (g_woSpeculation.enabled) {
+        g_woSpeculation.lookups++;
+        speculating = g_executor->tryEnqueue([emp, wo] {
+            Res236 r;
+            r.raw = SoapClient::sendRequest(236, emp, wo, &r.delivered);
+            return r;
+        }, spec236);
+        if (!speculating) g_woSpeculation.rejected++; // executor 滿了就退回依序查詢
+    }
+
+    // 3. 嘗試 CMD 235
+    bool delivered = false;
+    string res235 = SoapClient::sendRequest(235, emp, wo, &delivered);
+    
+    // [Req 4] 二次檢查：如果回傳空字串且沒有收到回應，代表連線剛剛超時或失敗了
+    if (res235.empty() && !delivered) {
+        if (speculating) g_woSpeculation.wasted++;
+        return jsonResponse(json{{"success", false}, {"type", "mes_offline"}, {"message", "因與 IT server 網路中斷，因此工單查詢失敗"}});
+    }
+
+    WorkOrderData d235 = parseSoapResponse(res235, wo, 235);
+    if (d235.valid) {
+        if (speculating) g_woSpeculation.wasted++; // 236 仍會在背景完成，結果不使用
+        if (insertDB) saveWorkOrderToDB(d235);
+        return workOrderResponse("API235", d235);
+    }
+
+    // 4. 嘗試 CMD 236
+    // 如果 235 只是查無資料(但連線正常)，才繼續查 236 (預先並行模式下直接取用已送出的結果)
+    string res236;
+    if (speculating) {
+        Res236 r = spec236.get();
+        res236 = r.raw;
+        delivered = r.delivered;
+        g_woSpeculation.used++;
+    } else {
+        res236 = SoapClient::sendRequest(236, emp, wo, &delivered);
+    }
+
+    // [Req 4] 同樣檢查 236 的連線狀況
+    if (res236.empty() && !delivered) {
+        return jsonResponse(json{{"success", false}, {"type", "mes_offline"}, {"message", "因與 IT server 網路中斷，因此工單查詢失敗"}});
+    }
+
+    WorkOrderData d236 = parseSoapResponse(res236, wo, 236);
+    if (d236.valid) {
+        if (insertDB) saveWorkOrderToDB(d236);
+        return workOrderResponse("API236", d236);
+    }
+
+    return jsonResponse(json{{"success", false}, {"message", res236}});
+}
+
+// json readPlcCameraIPFromDB(string machine_id) {
+//     MYSQL* con = dbPool->getConnection();
+//     if (!con) return nullptr;
+    
+//     json result = nullptr;
+//     string sql = "SELECT machine_id, hub_ip, camera_ip, camera_role FROM 2did_machine_cameras WHERE machine_id = '" + sql_escape(machine_id) + "'";
+
+//     if (mysql_query(con, sql.c_str()) == 0) {
+//         MYSQL_RES* res = mysql_store_result(con);
+//         if (res) {
+//             MYSQL_ROW row;
+//             vector<string> left_cam_ip, right_cam_ip;
+//             bool found = false;
+            
+//             while ((row = mysql_fetch_row(res))) {
+//                 if (!found) {
+//                     result["machine_id"] = machine_id;
+//                     result["hub_ip"] = row[1] ? row[1] : "";
+//                     found = true;
+//                 }
+
+//                 string role = row[3] ? row[3] : "";
+//                 string ip = row[2] ? row[2] : "";
+
+//                 if (role.find("LEFT") != string::npos) left_cam_ip.push_back(ip);
+//                 else if (role.find("RIGHT") != string::npos) right_cam_ip.push_back(ip);
+//             }
+//             if (found) {
+//                 result["cam"] = {{"left_cam_ip", left_cam_ip}, {"right_cam_ip", right_cam_ip}};
+//             }
+//             mysql_free_result(res);
+//         }
+//     }
+
+//     string sql = "SELECT machine_id, plc_ip, plc_port, plc_type, addr_write_trigger, addr_write_result, metadata FROM 2did_machine_info WHERE machine_id = '" + sql_escape(machine_id) + "'";
 //     if (mysql_query(con, sql.c_str()) == 0) {
 //         MYSQL_RES* res = mysql_store_result(con);
 //         if (res) {
@@ -551,206 +2696,1534 @@ json readWorkOrderFromDB(string wo) {
 //     return result;
 // }
 
-void saveScannedListToDB(const vector<ScannedData>& list) {
-    if (list.empty()) return;
-    MYSQL* con = dbPool->getConnection();
-    if (!con) return;
-    mysql_query(con, "START TRANSACTION");
+// --- 工單 OK/NG 計數彙總 ---
+// ✅ [效能優化] 每張工單的 OK/NG 增量先在記憶體彙總，再以
+// "SET OK_sum = OK_sum + ?, NG_sum = NG_sum + ?" 每張工單只更新一次，降低 2DID_workorder 熱點列的鎖競爭
+class CounterDeltas {
+public:
+    struct Delta { long long ok = 0, ng = 0; };
+    using Map = std::map<string, Delta>; // 有序：固定的更新順序可避免交易間互相 deadlock
+
+    static Map collect(const vector<ScannedData>& list) {
+        Map m;
+        for (const auto& d : list) {
+            if (d.ret_type == "OK") m[d.workOrder].ok++;
+            else m[d.workOrder].ng++;
+        }
+        return m;
+    }
+
+    // 在呼叫端的連線 (與交易) 上套用增量；err 不為 nullptr 時回填失敗的 statement 錯誤
+    static bool apply(MYSQL* con, const Map& deltas, DbError* err = nullptr) {
+        if (deltas.empty()) return true;
+        const char* q = "UPDATE 2DID_workorder SET OK_sum = OK_sum + ?, NG_sum = NG_sum + ? WHERE work_order = ?";
+        MYSQL_STMT* stmt = dbPool->prepareCached(con, q);
+        if (!stmt) {
+            if (err) *err = DbError{mysql_errno(con), mysql_error(con)};
+            return false;
+        }
+        bool ok = true;
+        for (auto it = deltas.begin(); ok && it != deltas.end(); ++it) {
+            MYSQL_BIND bind[3];
+            memset(bind, 0, sizeof(bind));
+            long long okv = it->second.ok, ngv = it->second.ng;
+            unsigned long wo_len = it->first.length();
+            bind[0].buffer_type = MYSQL_TYPE_LONGLONG; bind[0].buffer = (char*)&okv;
+            bind[1].buffer_type = MYSQL_TYPE_LONGLONG; bind[1].buffer = (char*)&ngv;
+            bind[2].buffer_type = MYSQL_TYPE_STRING;   bind[2].buffer = (char*)it->first.c_str(); bind[2].length = &wo_len;
+            ok = (mysql_stmt_bind_param(stmt, bind) == 0) && (mysql_stmt_execute(stmt) == 0);
+        }
+        if (!ok) {
+            LOG_ERROR("DB") << "Counter update failed: " << mysql_stmt_error(stmt);
+            if (err) *err = DbError{mysql_stmt_errno(stmt), mysql_stmt_error(stmt)};
+        }
+        return ok;
+    }
+
+    void add(const Map& deltas) {
+        lock_guard<mutex> lock(m_mutex);
+        for (const auto& kv : deltas) {
+            m_pending[kv.first].ok += kv.second.ok;
+            m_pending[kv.first].ng += kv.second.ng;
+        }
+    }
+
+    bool empty() {
+        lock_guard<mutex> lock(m_mutex);
+        return m_pending.empty();
+    }
+
+    // 取出累積的增量並寫入 DB；失敗時放回，下次再試
+    bool flush() {
+        Map snapshot;
+        {
+            lock_guard<mutex> lock(m_mutex);
+            if (m_pending.empty()) return true;
+            snapshot.swap(m_pending);
+        }
+        DbConnection con;
+        bool ok = false;
+        if (con) {
+            mysql_query(con, "START TRANSACTION");
+            ok = apply(con, snapshot) && (mysql_query(con, "COMMIT") == 0);
+            if (!ok) mysql_query(con, "ROLLBACK");
+        }
+        if (!ok) add(snapshot);
+        return ok;
+    }
+
+private:
+    mutex m_mutex;
+    Map m_pending;
+};
+
+CounterDeltas g_counterDeltas;
+
+// err 不為 nullptr 時回填失敗原因，呼叫端據此判斷要重試 (暫時性) 或隔離資料 (永久性)
+bool saveScannedListToDB(const vector<ScannedData>& list, DbError* err = nullptr) {
+    if (list.empty()) return true;
+    DbConnection con;
+    if (!con) {
+        if (err) *err = DbError{CR_CONNECTION_ERROR, "DB connection unavailable"};
+        return false;
+    }
+    // 記下第一個失敗的錯誤 (statement 的錯誤要從 statement 取得，ROLLBACK 也會清掉連線的錯誤狀態)
+    DbError failure;
+    auto connError = [&] { failure = DbError{mysql_errno(con), mysql_error(con)}; };
+
+    // ✅ [效能優化] 多列 INSERT 取代逐筆 execute (writer 需在歸還連線前解構)
+    bool insertOk = (mysql_query(con, "START TRANSACTION") == 0);
+    if (!insertOk) connError();
+    {
+        BulkInsertWriter writer(con, "INSERT INTO 2DID_scanned_products (work_order, sheet_no, panel_no, twodid_type, twodid_status, timestamp)", 6);
+        for (size_t i = 0; insertOk && i < list.size(); ++i) {
+            const ScannedData& d = list[i];
+            if (!writer.add({d.workOrder, d.sht_no, d.panel_no, d.ret_type, d.status, d.timestamp})) break;
+        }
+        if (insertOk && !writer.flush()) {
+            insertOk = false;
+            failure = DbError{writer.errorCode(), writer.error()};
+        }
+    }
+
+    // ✅ [新增] 同一交易內維護「每張 sheet 最新一筆掃描」，讀取端直接查這張表
+    // 只有時間不早於現有資料時才覆蓋 (timestamp 必須最後更新，前面的 IF 才會比較到舊值)
+    if (insertOk) {
+        BulkInsertWriter latest(con, "INSERT INTO 2DID_latest_scans (work_order, sheet_no, panel_no, twodid_type, twodid_status, timestamp)", 6,
+            " ON DUPLICATE KEY UPDATE"
+            " panel_no = IF(VALUES(timestamp) >= timestamp, VALUES(panel_no), panel_no),"
+            " twodid_type = IF(VALUES(timestamp) >= timestamp, VALUES(twodid_type), twodid_type),"
+            " twodid_status = IF(VALUES(timestamp) >= timestamp, VALUES(twodid_status), twodid_status),"
+            " timestamp = GREATEST(timestamp, VALUES(timestamp))");
+        for (const auto& d : list) {
+            if (!latest.add({d.workOrder, d.sht_no, d.panel_no, d.ret_type, d.status, d.timestamp})) break;
+        }
+        if (!latest.flush()) {
+            insertOk = false;
+            failure = DbError{latest.errorCode(), latest.error()};
+        }
+    }
+
+    // ✅ [修正] OK_sum / NG_sum 依工單彙總後一次加上實際筆數 (原本 IN (...) 每張工單只 +1)
+    CounterDeltas::Map deltas = CounterDeltas::collect(list);
+    if (insertOk && COUNTER_FLUSH_INTERVAL_MS <= 0) {
+        // 批次結束時在同一個交易內套用，與掃描紀錄一起 commit
+        insertOk = CounterDeltas::apply(con, deltas, &failure);
+    }
+
+    bool committed = insertOk && (mysql_query(con, "COMMIT") == 0);
+    if (insertOk && !committed) connError();
+    if (!committed) {
+        if (err) *err = failure;
+        mysql_query(con, "ROLLBACK");
+    }
+    con.release();
+
+    // 計時模式：累積在記憶體，由 write-behind writer 定期合併寫入
+    if (committed && COUNTER_FLUSH_INTERVAL_MS > 0) g_counterDeltas.add(deltas);
+
+    // 同步更新工單快取的掃描區段 (只影響已快取的工單)，並推送給有訂閱該工單的前端
+    if (committed) {
+        g_woCache.applyScans(list);
+        g_events.publishScans(list);
+    }
+    return committed;
+}
+
+// 永久性錯誤的掃描紀錄移到 2DID_scan_dead_letter (原始資料存成 JSON，不受原表欄位限制)，
+// 連這裡也寫不進去時至少完整寫進 log，供事後人工補登
+void deadLetterScans(const vector<ScannedData>& rows, const DbError& cause) {
+    DbConnection con;
+    for (const auto& d : rows) {
+        string payload = json{{"work_order", d.workOrder}, {"sheet_no", d.sht_no}, {"panel_no", d.panel_no},
+                               {"twodid_type", d.ret_type}, {"twodid_status", d.status}, {"timestamp", d.timestamp}}.dump();
+        string reason = to_string(cause.code) + ": " + cause.message.substr(0, 400);
+        if (!con || !execStmt(con, "INSERT INTO 2DID_scan_dead_letter (payload, error) VALUES (?, ?)", {payload, reason})) {
+            LOG_ERROR("ScanWriter") << "Dead letter write failed, row: " << payload << " (" << reason << ")";
+        } else {
+            LOG_WARN("ScanWriter") << "Moved row to dead letter: " << payload << " (" << reason << ")";
+        }
+    }
+}
+
+// --- 掃描紀錄 Write-Behind (Group Commit) ---
+// ✅ [效能優化] API handler 只把 ScannedData 放進有上限的佇列，由專屬 writer thread
+// 把 SCAN_GROUP_COMMIT_MS 內累積的資料合併成「一個交易」寫入，burst 掃描時 N 次 commit 變成少數幾次。
+// - Async: 放入佇列即回應 (最快，程式異常終止時佇列內資料會遺失)
+// - Sync : 等待所在批次 COMMIT 後才回應 (仍與其他請求共用同一個 commit)
+class ScanWriteBehind {
+public:
+    enum class Result {
+        Queued,       // Async：已放入佇列
+        Committed,    // Sync：整組已 COMMIT
+        DeadLettered, // Sync：整組因永久性錯誤 (資料本身有問題) 移到 2DID_scan_dead_letter，重送也會再失敗
+        Failed,       // 整組都沒有寫入 (DB 失敗、或逾時後已從佇列撤回)，呼叫端可安全重送
+        Pending,      // Sync 逾時且 writer 正在寫入，無法確認結果
+        Rejected      // 佇列已滿或已停止，呼叫端應改為同步寫入
+    };
+
+private:
+    struct Pending {
+        ScannedData data;
+        shared_ptr<promise<Result>> ticket; // 只掛在每次 enqueue 的最後一筆
+    };
+
+public:
+    ScanWriteBehind(size_t capacity, ScanDurability durability)
+        : m_capacity(capacity), m_durability(durability) {}
+
+    void start() {
+        m_worker = thread([this]{ run(); });
+    }
+
+    Result enqueue(const vector<ScannedData>& items) {
+        if (items.empty()) return m_durability == ScanDurability::Sync ? Result::Committed : Result::Queued;
+        shared_ptr<promise<Result>> ticket;
+        future<Result> done;
+        if (m_durability == ScanDurability::Sync) {
+            ticket = make_shared<promise<Result>>();
+            done = ticket->get_future();
+        }
+        {
+            unique_lock<mutex> lock(m_mutex);
+            // 佇列滿時最多等待一下 (backpressure)，仍然滿就交回呼叫端
+            if (!m_notFull.wait_for(lock, std::chrono::milliseconds(SCAN_ENQUEUE_TIMEOUT_MS),
+                                    [&]{ return m_stop || m_queue.size() + items.size() <= m_capacity; }) || m_stop) {
+                m_rejected += items.size();
+                return Result::Rejected;
+            }
+            for (size_t i = 0; i < items.size(); ++i) {
+                m_queue.push_back({items[i], (i + 1 == items.size()) ? ticket : nullptr});
+            }
+        }
+        m_notEmpty.notify_one();
+
+        if (!ticket) return Result::Queued;
+
+        // DB 異常時不讓前端無限等待：逾時後若資料還在佇列就撤回，明確回報「沒有寫入」
+        if (done.wait_for(std::chrono::milliseconds(SCAN_SYNC_WAIT_MS)) == std::future_status::ready) return done.get();
+        bool withdrawn = false;
+        {
+            lock_guard<mutex> lock(m_mutex);
+            for (size_t i = 0; i < m_queue.size(); ++i) {
+                if (m_queue[i].ticket != ticket) continue;
+                // 同一次 enqueue 的資料不會被拆到不同批次，ticket 還在佇列代表整組都還在
+                m_queue.erase(m_queue.begin() + (i + 1 - items.size()), m_queue.begin() + i + 1);
+                m_withdrawn += items.size();
+                withdrawn = true;
+                break;
+            }
+        }
+        if (withdrawn) {
+            m_notFull.notify_all();
+            return Result::Failed;
+        }
+        if (done.wait_for(std::chrono::milliseconds(0)) == std::future_status::ready) return done.get();
+        return Result::Pending;
+    }
+
+    // 等待目前佇列中的資料全部寫入 (或放棄)
+    void flush() {
+        unique_lock<mutex> lock(m_mutex);
+        m_idle.wait(lock, [&]{ return m_queue.empty() && !m_busy; });
+    }
+
+    // 程式結束前呼叫：寫完剩餘資料後停止 writer thread
+    void shutdown() {
+        {
+            lock_guard<mutex> lock(m_mutex);
+            if (m_stop) return;
+            m_stop = true;
+        }
+        m_notEmpty.notify_all();
+        m_notFull.notify_all();
+        if (m_worker.joinable()) m_worker.join();
+    }
+
+    json stats() {
+        lock_guard<mutex> lock(m_mutex);
+        uint64_t b = m_batches, r = m_rows;
+        return json{{"queue_depth", m_queue.size()}, {"capacity", m_capacity},
+                    {"durability", m_durability == ScanDurability::Sync ? "sync" : "async"},
+                    {"batches", b}, {"rows", r}, {"avg_batch_size", b ? (double)r / b : 0.0},
+                    {"retries", m_retries}, {"rejected", m_rejected}, {"withdrawn", m_withdrawn}, {"dead_lettered", m_deadLettered}, {"dropped", m_dropped}};
+    }
+
+private:
+    enum class RowState { Pending, Committed, DeadLettered };
+
+    // 寫入 rows[begin, end)：暫時性錯誤 (斷線、deadlock) 退避重試；
+    // 永久性錯誤 (資料過長、違反限制) 重試也沒用，對半切分找出有問題的資料列移到 dead letter，其餘照常 commit，
+    // 一筆壞資料不會卡住所有平板的掃描寫入。停止中只再試一次，避免程式無法結束。
+    // cuts 是可以切開的位置 (遞增)：Sync 模式只在每次 enqueue 的邊界切開，同一組資料不會一半 commit、一半 dead letter
+    void writeRange(const vector<ScannedData>& rows, size_t begin, size_t end, const vector<size_t>& cuts, vector<RowState>& state) {
+        vector<ScannedData> part(rows.begin() + begin, rows.begin() + end);
+        DbError err;
+        int backoff = 500;
+        bool retriedOnStop = false;
+        while (!saveScannedListToDB(part, &err)) {
+            if (!isTransientDbError(err.code)) {
+                size_t mid = splitPoint(begin, end, cuts);
+                if (mid == begin) {
+                    deadLetterScans(part, err);
+                    std::fill(state.begin() + begin, state.begin() + end, RowState::DeadLettered);
+                    return;
+                }
+                LOG_WARN("ScanWriter") << "Batch rejected (" << err.code << ": " << err.message << "), splitting " << part.size() << " rows";
+                writeRange(rows, begin, mid, cuts, state);
+                writeRange(rows, mid, end, cuts, state);
+                return;
+            }
+            bool stopping;
+            { lock_guard<mutex> lock(m_mutex); m_retries++; stopping = m_stop; }
+            if (stopping) {
+                if (retriedOnStop) return;
+                retriedOnStop = true;
+                continue;
+            }
+            LOG_ERROR("ScanWriter") << "DB write failed (" << err.code << ": " << err.message << "), retry in " << backoff << " ms (" << part.size() << " rows)";
+            std::this_thread::sleep_for(std::chrono::milliseconds(backoff));
+            backoff = std::min(backoff * 2, 10000);
+        }
+        std::fill(state.begin() + begin, state.begin() + end, RowState::Committed);
+    }
+
+    // (begin, end) 之間最接近中點的可切開位置；沒有時回傳 begin (這一段不可再切)
+    static size_t splitPoint(size_t begin, size_t end, const vector<size_t>& cuts) {
+        size_t mid = begin + (end - begin) / 2;
+        auto it = std::lower_bound(cuts.begin(), cuts.end(), mid);
+        size_t best = begin;
+        if (it != cuts.end() && *it > begin && *it < end) best = *it;
+        if (it != cuts.begin() && *(it - 1) > begin && *(it - 1) < end &&
+            (best == begin || mid - *(it - 1) < *it - mid)) best = *(it - 1);
+        return best;
+    }
+
+    void run() {
+        auto nextCounterFlush = std::chrono::steady_clock::now() + std::chrono::milliseconds(COUNTER_FLUSH_INTERVAL_MS);
+        for (;;) {
+            // 計時模式下順便負責定期寫入 OK/NG 計數
+            if (COUNTER_FLUSH_INTERVAL_MS > 0 && std::chrono::steady_clock::now() >= nextCounterFlush) {
+                g_counterDeltas.flush();
+                nextCounterFlush = std::chrono::steady_clock::now() + std::chrono::milliseconds(COUNTER_FLUSH_INTERVAL_MS);
+            }
+
+            vector<Pending> batch;
+            {
+                unique_lock<mutex> lock(m_mutex);
+                if (COUNTER_FLUSH_INTERVAL_MS > 0) {
+                    if (!m_notEmpty.wait_until(lock, nextCounterFlush, [&]{ return m_stop || !m_queue.empty(); })) continue;
+                } else {
+                    m_notEmpty.wait(lock, [&]{ return m_stop || !m_queue.empty(); });
+                }
+                if (m_stop && m_queue.empty()) break;
+
+                // Group commit：等待一小段時間讓其他請求的資料一起進來
+                if (!m_stop && m_queue.size() < SCAN_GROUP_COMMIT_MAX_ROWS) {
+                    m_notEmpty.wait_for(lock, std::chrono::milliseconds(SCAN_GROUP_COMMIT_MS),
+                                        [&]{ return m_stop || m_queue.size() >= SCAN_GROUP_COMMIT_MAX_ROWS; });
+                }
+                size_t n = std::min(m_queue.size(), SCAN_GROUP_COMMIT_MAX_ROWS);
+                // Sync 模式不拆開同一次 enqueue 的資料，ticket 才能代表整組的結果
+                if (m_durability == ScanDurability::Sync) {
+                    while (n < m_queue.size() && !m_queue[n - 1].ticket) ++n;
+                }
+                batch.assign(std::make_move_iterator(m_queue.begin()), std::make_move_iterator(m_queue.begin() + n));
+                m_queue.erase(m_queue.begin(), m_queue.begin() + n);
+                m_busy = true;
+            }
+            m_notFull.notify_all();
+
+            vector<ScannedData> rows;
+            rows.reserve(batch.size());
+            for (const auto& p : batch) rows.push_back(p.data);
+
+            // Async 每一列都可切開；Sync 只能在 enqueue 邊界 (ticket 之後) 切開
+            vector<size_t> cuts;
+            for (size_t i = 1; i < batch.size(); ++i) {
+                if (m_durability == ScanDurability::Async || batch[i - 1].ticket) cuts.push_back(i);
+            }
+            vector<RowState> state(rows.size(), RowState::Pending);
+            writeRange(rows, 0, rows.size(), cuts, state);
+
+            // 同一組的資料結果一致，以該組最後一筆 (掛 ticket 的那筆) 回報
+            size_t committed = 0, deadLettered = 0;
+            for (size_t i = 0; i < batch.size(); ++i) {
+                if (state[i] == RowState::Committed) committed++;
+                if (state[i] == RowState::DeadLettered) deadLettered++;
+                if (batch[i].ticket) {
+                    batch[i].ticket->set_value(state[i] == RowState::Committed    ? Result::Committed
+                                             : state[i] == RowState::DeadLettered ? Result::DeadLettered
+                                                                                  : Result::Failed);
+                }
+            }
+            {
+                lock_guard<mutex> lock(m_mutex);
+                if (committed) { m_batches++; m_rows += committed; }
+                m_deadLettered += deadLettered;
+                size_t dropped = rows.size() - committed - deadLettered;
+                if (dropped) {
+                    m_dropped += dropped;
+                    LOG_ERROR("ScanWriter") << "Dropped " << dropped << " rows on shutdown";
+                }
+                m_busy = false;
+            }
+            m_idle.notify_all();
+        }
+        // 停止前把尚未寫入的 OK/NG 計數寫完
+        if (!g_counterDeltas.empty() && !g_counterDeltas.flush()) {
+            LOG_ERROR("ScanWriter") << "Failed to flush pending OK/NG counters on shutdown";
+        }
+        m_idle.notify_all();
+    }
+
+    size_t m_capacity;
+    ScanDurability m_durability;
+    deque<Pending> m_queue;
+    mutex m_mutex;
+    condition_variable m_notEmpty, m_notFull, m_idle;
+    thread m_worker;
+    bool m_stop = false;
+    bool m_busy = false;
+    uint64_t m_batches = 0, m_rows = 0, m_retries = 0, m_rejected = 0, m_withdrawn = 0, m_deadLettered = 0, m_dropped = 0;
+};
+
+ScanWriteBehind g_scanWriter(SCAN_QUEUE_CAPACITY, SCAN_DURABILITY);
+
+// API 用：交給 write-behind (佇列滿時改為同步寫入)，回傳資料是否已確實寫入 / 排入
+ScanWriteBehind::Result storeScans(const vector<ScannedData>& list) {
+    ScanWriteBehind::Result r = g_scanWriter.enqueue(list);
+    if (r != ScanWriteBehind::Result::Rejected) return r;
+    return saveScannedListToDB(list) ? ScanWriteBehind::Result::Committed : ScanWriteBehind::Result::Failed;
+}
+
+bool scanStoreFailed(ScanWriteBehind::Result r) {
+    return r == ScanWriteBehind::Result::Failed || r == ScanWriteBehind::Result::Pending ||
+           r == ScanWriteBehind::Result::DeadLettered;
+}
+
+// 沒有寫入時的回應：Failed (503) 整組都沒有寫入，可安全重送；Pending (503) 仍在寫入中，結果未知；
+// DeadLettered (422) 資料本身無法寫入，已保留在 2DID_scan_dead_letter 待人工處理，不應重送
+crow::response scanStoreFailure(ScanWriteBehind::Result r) {
+    string mes = g_mesBreaker.isOnline() ? "online" : "offline";
+    if (r == ScanWriteBehind::Result::DeadLettered) {
+        return crow::response(422, json{{"success", false}, {"type", "db_rejected"},
+            {"message", "掃描紀錄無法寫入資料庫 (資料異常)，已保留待人工處理，請勿重新上傳"}, {"mes_status", mes}}.dump());
+    }
+    bool pending = (r == ScanWriteBehind::Result::Pending);
+    return crow::response(503, json{{"success", false}, {"type", pending ? "db_pending" : "db_error"},
+        {"message", pending ? "掃描紀錄寫入逾時，尚未確認是否已寫入資料庫" : "掃描紀錄寫入資料庫失敗，請重新上傳"},
+        {"mes_status", mes}}.dump());
+}
+
+// --- 本地 Outbox (MES 未送出訊息的落地佇列) ---
+// ✅ [可靠性] 所有未送出的 239 訊息先寫入本地 memory-mapped segment log，不依賴 DB 連線：
+// - Append 只是 memcpy 到 mapping，延遲在微秒等級，不會因 DB 斷線而卡住 3 秒 connect timeout
+// - 背景 thread 每 OUTBOX_FSYNC_INTERVAL_MS 批次 flush 到磁碟 (程式當掉時資料仍在 OS page cache)
+// - MonitorLoop 從 outbox 取出資料轉存 DB (或 DB 斷線時直接補送 MES)，確認後標記 ack，整個 segment 都 ack 後刪檔
+// 檔案格式: [magic][length][crc32][state] + payload(emp_len, emp, msg)，每筆 8 bytes 對齊
+
+// 跨平台的讀寫 memory-mapped file
+class MappedFile {
+public:
+    MappedFile() = default;
+    ~MappedFile() { close(); }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const string& path, size_t size) {
+#ifdef _WIN32
+        m_file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+                             OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (m_file == INVALID_HANDLE_VALUE) return false;
+        LARGE_INTEGER cur;
+        if (!GetFileSizeEx(m_file, &cur)) { close(); return false; }
+        if ((size_t)cur.QuadPart < size) {
+            LARGE_INTEGER sz; sz.QuadPart = (LONGLONG)size;
+            if (!SetFilePointerEx(m_file, sz, NULL, FILE_BEGIN) || !SetEndOfFile(m_file)) { close(); return false; }
+        } else {
+            size = (size_t)cur.QuadPart;
+        }
+        m_mapping = CreateFileMappingA(m_file, NULL, PAGE_READWRITE, (DWORD)((unsigned long long)size >> 32), (DWORD)(size & 0xFFFFFFFF), NULL);
+        if (!m_mapping) { close(); return false; }
+        m_data = (char*)MapViewOfFile(m_mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+        if (!m_data) { close(); return false; }
+#else
+        m_fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (m_fd < 0) return false;
+        struct stat st;
+        if (fstat(m_fd, &st) != 0) { close(); return false; }
+        if ((size_t)st.st_size < size) {
+            if (ftruncate(m_fd, (off_t)size) != 0) { close(); return false; }
+        } else {
+            size = (size_t)st.st_size;
+        }
+        void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+        if (p == MAP_FAILED) { close(); return false; }
+        m_data = (char*)p;
+#endif
+        m_size = size;
+        return true;
+    }
+
+    // 將 [offset, offset + len) 寫回磁碟
+    bool sync(size_t offset, size_t len) {
+        if (!m_data || len == 0) return true;
+#ifdef _WIN32
+        return FlushViewOfFile(m_data + offset, len) && FlushFileBuffers(m_file);
+#else
+        static const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t start = offset - (offset % page);
+        return msync(m_data + start, len + (offset - start), MS_SYNC) == 0;
+#endif
+    }
+
+    void close() {
+#ifdef _WIN32
+        if (m_data) UnmapViewOfFile(m_data);
+        if (m_mapping) CloseHandle(m_mapping);
+        if (m_file != INVALID_HANDLE_VALUE) CloseHandle(m_file);
+        m_mapping = NULL;
+        m_file = INVALID_HANDLE_VALUE;
+#else
+        if (m_data) munmap(m_data, m_size);
+        if (m_fd >= 0) ::close(m_fd);
+        m_fd = -1;
+#endif
+        m_data = nullptr;
+        m_size = 0;
+    }
+
+    char* data() { return m_data; }
+    size_t size() const { return m_size; }
+
+private:
+#ifdef _WIN32
+    HANDLE m_file = INVALID_HANDLE_VALUE;
+    HANDLE m_mapping = NULL;
+#else
+    int m_fd = -1;
+#endif
+    char* m_data = nullptr;
+    size_t m_size = 0;
+};
+
+uint32_t crc32(const char* data, size_t len) {
+    static uint32_t table[256];
+    static std::once_flag once;
+    std::call_once(once, []{
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+    });
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < len; ++i) crc = table[(crc ^ (unsigned char)data[i]) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFFu;
+}
+
+struct OutboxItem {
+    uint64_t segment;
+    size_t offset;
+    string emp, msg;
+};
+
+class Outbox {
+    static constexpr uint32_t MAGIC = 0x3158424F; // "OBX1"
+    static constexpr uint32_t STATE_PENDING = 0, STATE_ACKED = 1;
+    struct RecordHeader { uint32_t magic, length, crc, state; };
+
+    struct Segment {
+        uint64_t id;
+        string path;
+        MappedFile file;
+        size_t writeOff = 0;   // 下一筆寫入位置
+        size_t readOff = 0;    // 第一筆尚未 ack 的位置
+        size_t pending = 0;
+        bool sealed = false;
+        size_t dirtyFrom = SIZE_MAX, dirtyTo = 0;
+        void markDirty(size_t from, size_t to) { dirtyFrom = std::min(dirtyFrom, from); dirtyTo = std::max(dirtyTo, to); }
+    };
+
+public:
+    Outbox(string dir, size_t segmentBytes) : m_dir(std::move(dir)), m_segmentBytes(segmentBytes) {}
+    ~Outbox() { stop(); }
+
+    // 啟動時呼叫：掃描既有 segment 還原未 ack 的資料，並啟動 flush thread
+    bool start() {
+        std::error_code ec;
+        std::filesystem::create_directories(m_dir, ec);
+        vector<uint64_t> ids;
+        for (const auto& f : std::filesystem::directory_iterator(m_dir, ec)) {
+            string name = f.path().filename().string();
+            if (name.size() == 18 && name.compare(0, 4, "seg_") == 0 && name.compare(14, 4, ".obx") == 0) {
+                ids.push_back(std::stoull(name.substr(4, 10)));
+            }
+        }
+        std::sort(ids.begin(), ids.end());
+        {
+            lock_guard<mutex> lock(m_mutex);
+            for (uint64_t id : ids) recoverSegment(id);
+            m_nextId = ids.empty() ? 1 : ids.back() + 1;
+            // 上次的最後一個 segment 可能有寫到一半的紀錄，一律 seal 後開新檔
+            if (!openSegment()) {
+                LOG_ERROR("Outbox") << "Cannot create segment in " << m_dir;
+                return false;
+            }
+        }
+        if (m_pending > 0) LOG_INFO("Outbox") << "Recovered " << m_pending << " unsent messages.";
+        m_flusher = thread([this]{ flushLoop(); });
+        return true;
+    }
+
+    void stop() {
+        {
+            lock_guard<mutex> lock(m_mutex);
+            if (m_stop) return;
+            m_stop = true;
+        }
+        m_cv.notify_all();
+        if (m_flusher.joinable()) m_flusher.join();
+        unique_lock<mutex> lock(m_mutex);
+        syncDirty(lock);
+    }
+
+    bool append(const string& emp, const string& msg) {
+        uint32_t payloadLen = (uint32_t)(4 + emp.size() + msg.size());
+        size_t recLen = align8(sizeof(RecordHeader) + payloadLen);
+
+        lock_guard<mutex> lock(m_mutex);
+        Segment* seg = m_segments.empty() ? nullptr : m_segments.back().get();
+        if (!seg || seg->sealed || seg->writeOff + recLen > seg->file.size()) {
+            if (seg) seg->sealed = true;
+            if (recLen > m_segmentBytes || !openSegment()) {
+                m_failed++;
+                LOG_ERROR("Outbox") << "Append failed, message size " << msg.size();
+                return false;
+            }
+            seg = m_segments.back().get();
+        }
+
+        char* base = seg->file.data() + seg->writeOff;
+        char* p = base + sizeof(RecordHeader);
+        uint32_t empLen = (uint32_t)emp.size();
+        memcpy(p, &empLen, 4);
+        memcpy(p + 4, emp.data(), emp.size());
+        memcpy(p + 4 + emp.size(), msg.data(), msg.size());
+
+        RecordHeader h{0, payloadLen, crc32(p, payloadLen), STATE_PENDING};
+        memcpy(base, &h, sizeof(h));
+        // magic 最後寫入：程式在寫入途中終止時，這筆在還原時會被視為不存在
+        memcpy(base, &MAGIC, 4);
+
+        seg->markDirty(seg->writeOff, seg->writeOff + recLen);
+        seg->writeOff += recLen;
+        seg->pending++;
+        m_pending++;
+        m_appended++;
+        return true;
+    }
+
+    // 依寫入順序取出最多 max 筆尚未 ack 的資料 (不會移除，需呼叫 ack)
+    size_t peek(size_t max, vector<OutboxItem>& out) {
+        lock_guard<mutex> lock(m_mutex);
+        for (auto& seg : m_segments) {
+            size_t off = seg->readOff;
+            while (out.size() < max && off < seg->writeOff) {
+                const char* base = seg->file.data() + off;
+                RecordHeader h;
+                memcpy(&h, base, sizeof(h));
+                if (h.state == STATE_PENDING) {
+                    const char* p = base + sizeof(RecordHeader);
+                    uint32_t empLen;
+                    memcpy(&empLen, p, 4);
+                    out.push_back({seg->id, off, string(p + 4, empLen), string(p + 4 + empLen, h.length - 4 - empLen)});
+                }
+                off += align8(sizeof(RecordHeader) + h.length);
+            }
+            if (out.size() >= max) break;
+        }
+        return out.size();
+    }
+
+    // 標記已送達 (已寫入 DB 或已送到 MES)，整個 segment 都 ack 後刪除檔案
+    void ack(const vector<OutboxItem>& items) {
+        lock_guard<mutex> lock(m_mutex);
+        for (const auto& it : items) {
+            Segment* seg = findSegment(it.segment);
+            if (!seg || it.offset >= seg->writeOff) continue;
+            char* base = seg->file.data() + it.offset;
+            RecordHeader h;
+            memcpy(&h, base, sizeof(h));
+            if (h.state != STATE_PENDING) continue;
+            memcpy(base + offsetof(RecordHeader, state), &STATE_ACKED, 4);
+            seg->markDirty(it.offset, it.offset + sizeof(RecordHeader));
+            seg->pending--;
+            m_pending--;
+            m_acked++;
+        }
+        truncateAcked();
+    }
+
+    size_t pending() {
+        lock_guard<mutex> lock(m_mutex);
+        return m_pending;
+    }
+
+    json stats() {
+        lock_guard<mutex> lock(m_mutex);
+        return json{{"pending", m_pending}, {"segments", m_segments.size()}, {"appended", m_appended},
+                    {"acked", m_acked}, {"append_failed", m_failed}, {"dir", m_dir}};
+    }
+
+private:
+    static size_t align8(size_t n) { return (n + 7) & ~(size_t)7; }
+
+    string segmentPath(uint64_t id) {
+        char name[32];
+        snprintf(name, sizeof(name), "seg_%010llu.obx", (unsigned long long)id);
+        return (std::filesystem::path(m_dir) / name).string();
+    }
+
+    bool openSegment() {
+        auto seg = make_unique<Segment>();
+        seg->id = m_nextId++;
+        seg->path = segmentPath(seg->id);
+        if (!seg->file.open(seg->path, m_segmentBytes)) return false;
+        m_segments.push_back(std::move(seg));
+        return true;
+    }
+
+    void recoverSegment(uint64_t id) {
+        auto seg = make_unique<Segment>();
+        seg->id = id;
+        seg->path = segmentPath(id);
+        seg->sealed = true;
+        if (!seg->file.open(seg->path, 0)) {
+            LOG_ERROR("Outbox") << "Cannot open " << seg->path;
+            return;
+        }
+        size_t off = 0, size = seg->file.size();
+        bool firstPendingFound = false;
+        while (off + sizeof(RecordHeader) <= size) {
+            const char* base = seg->file.data() + off;
+            RecordHeader h;
+            memcpy(&h, base, sizeof(h));
+            if (h.magic != MAGIC || h.length < 4 || off + sizeof(RecordHeader) + h.length > size) break;
+            if (crc32(base + sizeof(RecordHeader), h.length) != h.crc) break; // 寫到一半的紀錄
+            if (h.state == STATE_PENDING) {
+                if (!firstPendingFound) { seg->readOff = off; firstPendingFound = true; }
+                seg->pending++;
+            }
+            off += align8(sizeof(RecordHeader) + h.length);
+        }
+        seg->writeOff = off;
+        if (!firstPendingFound) seg->readOff = off;
+        if (seg->pending == 0) {
+            seg->file.close();
+            std::error_code ec;
+            std::filesystem::remove(seg->path, ec);
+            return;
+        }
+        m_pending += seg->pending;
+        m_segments.push_back(std::move(seg));
+    }
+
+    Segment* findSegment(uint64_t id) {
+        for (auto& s : m_segments) if (s->id == id) return s.get();
+        return nullptr;
+    }
+
+    // 推進 readOff，並刪除已全部 ack 的舊 segment
+    void truncateAcked() {
+        for (auto& seg : m_segments) {
+            while (seg->readOff < seg->writeOff) {
+                RecordHeader h;
+                memcpy(&h, seg->file.data() + seg->readOff, sizeof(h));
+                if (h.state == STATE_PENDING) break;
+                seg->readOff += align8(sizeof(RecordHeader) + h.length);
+            }
+        }
+        while (m_segments.size() > 1 && m_segments.front()->sealed && m_segments.front()->pending == 0) {
+            // flush thread 可能正在 (不持有 m_mutex) sync 這個 segment，等它完成後才能 unmap
+            lock_guard<mutex> syncLock(m_syncMutex);
+            auto& seg = m_segments.front();
+            seg->file.close();
+            std::error_code ec;
+            std::filesystem::remove(seg->path, ec);
+            m_segments.pop_front();
+        }
+    }
+
+    // 呼叫時須持有 lock (m_mutex)：在鎖內取出並清除 dirty 範圍，放開鎖後才 msync / FlushFileBuffers，
+    // 磁碟同步期間 append / ack 不會被擋住。m_syncMutex 保護 segment 在 sync 期間不被刪除
+    void syncDirty(unique_lock<mutex>& lock) {
+        struct Range { MappedFile* file; size_t from, len; };
+        vector<Range> ranges;
+        for (auto& seg : m_segments) {
+            if (seg->dirtyFrom >= seg->dirtyTo) continue;
+            ranges.push_back({&seg->file, seg->dirtyFrom, seg->dirtyTo - seg->dirtyFrom});
+            seg->dirtyFrom = SIZE_MAX;
+            seg->dirtyTo = 0;
+        }
+        if (ranges.empty()) return;
+        unique_lock<mutex> syncLock(m_syncMutex);
+        lock.unlock();
+        for (const auto& r : ranges) r.file->sync(r.from, r.len);
+        syncLock.unlock();  // 先放開 m_syncMutex 再拿回 m_mutex，維持上鎖順序
+        lock.lock();
+    }
+
+    void flushLoop() {
+        unique_lock<mutex> lock(m_mutex);
+        while (!m_stop) {
+            m_cv.wait_for(lock, std::chrono::milliseconds(OUTBOX_FSYNC_INTERVAL_MS), [&]{ return m_stop; });
+            syncDirty(lock);
+        }
+    }
+
+    string m_dir;
+    size_t m_segmentBytes;
+    deque<unique_ptr<Segment>> m_segments;
+    uint64_t m_nextId = 1;
+    size_t m_pending = 0;
+    uint64_t m_appended = 0, m_acked = 0, m_failed = 0;
+    mutex m_mutex;
+    mutex m_syncMutex;  // 順序：m_mutex -> m_syncMutex
+    condition_variable m_cv;
+    thread m_flusher;
+    bool m_stop = false;
+};
+
+Outbox g_outbox(getEnvOr("BACKEND_OUTBOX_DIR", OUTBOX_DIR), OUTBOX_SEGMENT_BYTES);
+
+// ✅ [安全修正] 改用 Prepared Statement，防止 SQL Injection
+// ✅ [效能優化] 由 MonitorLoop 將 outbox 的資料整批轉存 DB (單一交易 + 多列 INSERT)
+bool saveUnsentMessages(const vector<OutboxItem>& items) {
+    if (items.empty()) return true;
+    DbConnection con;
+    if (!con) return false;
+
+    mysql_query(con, "START TRANSACTION");
+    bool ok;
+    {
+        // work_order 供多台 instance 依工單認領補送 (見 BacklogReplayer)
+        BulkInsertWriter writer(con, "INSERT INTO 2DID_unsent_messages (emp_no, message, work_order)", 3);
+        for (const auto& it : items) {
+            if (!writer.add({it.emp, it.msg, it.msg.substr(0, it.msg.find(';'))})) break;
+        }
+        ok = writer.flush();
+    }
+    ok = ok && (mysql_query(con, "COMMIT") == 0);
+    if (!ok) mysql_query(con, "ROLLBACK");
+    return ok;
+}
+
+// 將 outbox 的資料搬到 DB；DB 無法連線但 MES 在線時直接補送 MES
+// 回傳處理 (ack) 的筆數
+size_t drainOutbox() {
+    vector<OutboxItem> items;
+    if (g_outbox.peek(OUTBOX_DRAIN_BATCH, items) == 0) return 0;
+
+    if (saveUnsentMessages(items)) {
+        g_outbox.ack(items);
+        return items.size();
+    }
+
+    if (!g_mesBreaker.isOnline()) return 0;
+    vector<OutboxItem> sent;
+    for (auto& it : items) {
+        // 以是否收到 MES 的 HTTP 200 判斷送達，result 欄位為空的正常回應不應重送
+        bool delivered = false;
+        SoapClient::sendRequest(239, it.emp, it.msg, &delivered);
+        if (!delivered) {
+            LOG_WARN("System") << "MES send failed during outbox replay.";
+            break;
+        }
+        sent.push_back(std::move(it));
+    }
+    g_outbox.ack(sent);
+    return sent.size();
+}
+// ✅ [Req 3] 安全上傳函式：封裝了「嘗試傳送 -> 失敗寫入 outbox」的邏輯
+// 這會被 write2did 與 write2dids 共用
+void SafeSoapCall(string emp, string msg) {
+    // [Req 3.2] 斷路器開啟時 sendRequest 會直接失敗，不浪費時間連線
+    // 嘗試發送 (使用標準 3s timeout)
+    bool delivered = false;
+    SoapClient::sendRequest(239, emp, msg, &delivered);
+
+    // [Req 3.1] 沒有收到 MES 的 HTTP 200 (連線失敗 / 斷路器開啟) 才寫入 outbox (由 MonitorLoop 轉存 DB)
+    // result 為空的正常回應代表 MES 已收到，不重送；是否切換離線由斷路器依失敗率判斷
+    if (!delivered) {
+        g_outbox.append(emp, msg);
+    }
+}
+
+// --- 積壓訊息補送引擎 (Backlog Replay) ---
+// ✅ [效能優化] 取代原本「每批 10 筆、逐筆送出、每批休息 200ms」的補送方式：
+// - 依工單分組，不同工單以 REPLAY_WINDOW 個 worker 並行送出，同一工單內維持 id 順序
+// - MES 持續正常時批次大小倍增 (最多 REPLAY_MAX_BATCH)，失敗時減半
+// - 成功的 id 每 REPLAY_RENEW_INTERVAL_MS 批次 DELETE 並同時續約，大批次送超過租約長度也不會被其他 instance 接手
+// - 多台 instance 共用同一張表時，以 claim_owner / claim_expires 租約依工單分配，不會重複送出
+// - DELETE 失敗的 id 記在記憶體中稍後重刪，不會再次送出
+class BacklogReplayer {
+public:
+    struct Result {
+        bool dbOk = true;
+        size_t fetched = 0, sent = 0;
+    };
+
+    BacklogReplayer() : m_pool("replay", REPLAY_WINDOW, REPLAY_WINDOW * 2) {}
+
+    Result runOnce() {
+        Result r;
+        struct Row { long long id; string emp, msg; };
+        vector<Row> rows;
+
+        // 上一輪已送出但 DELETE 失敗的 id 先補刪，DB 仍異常就不送新資料
+        if (!retryPendingDeletes()) {
+            renewClaims();
+            r.dbOk = false;
+            return r;
+        }
+
+        DbConnection con;
+        if (!con) { r.dbOk = false; return r; }
+
+        // ✅ [多台部署] 先以租約認領整張工單的積壓資料，避免多台 instance 重複送出同一筆 239
+        // 已被其他 instance 認領且未逾期的工單會被略過；自己的租約在此一併續期
+        const char* claimSql =
+            "UPDATE 2DID_unsent_messages u "
+            "JOIN (SELECT work_order FROM 2DID_unsent_messages GROUP BY work_order "
+            "      HAVING SUM(claim_owner IS NOT NULL AND claim_owner <> ? AND claim_expires > NOW()) = 0 "
+            "      ORDER BY MIN(id) LIMIT ?) w ON u.work_order <=> w.work_order "
+            "SET u.claim_owner = ?, u.claim_expires = NOW() + INTERVAL ? SECOND "
+            "WHERE u.claim_owner IS NULL OR u.claim_owner = ? OR u.claim_expires <= NOW()";
+        if (!execStmt(con, claimSql, {INSTANCE_ID, (long long)REPLAY_CLAIM_WORKORDERS, INSTANCE_ID, REPLAY_LEASE_SEC, INSTANCE_ID})) {
+            r.dbOk = false;
+            return r;
+        }
+
+        // 只取出「同工單中較早的資料也都由自己認領」的列，確保跨 instance 仍維持工單內順序
+        string owner = "'" + sql_escape(INSTANCE_ID) + "'";
+        string sql = "SELECT u.id, u.emp_no, u.message FROM 2DID_unsent_messages u "
+                     "WHERE u.claim_owner = " + owner + " "
+                     "AND NOT EXISTS (SELECT 1 FROM 2DID_unsent_messages e "
+                     "                WHERE e.work_order <=> u.work_order AND e.id < u.id AND NOT (e.claim_owner <=> " + owner + ")) "
+                     "ORDER BY u.id ASC LIMIT " + to_string(m_batch);
+        if (mysql_query(con, sql.c_str()) == 0) {
+            MYSQL_RES* res = mysql_store_result(con);
+            if (res) {
+                MYSQL_ROW row;
+                while ((row = mysql_fetch_row(res))) {
+                    rows.push_back({stoll(row[0]), row[1] ? row[1] : "", row[2] ? row[2] : ""});
+                }
+                mysql_free_result(res);
+            }
+        } else {
+            r.dbOk = false;
+        }
+        con.release();
+        r.fetched = rows.size();
+        if (rows.empty()) {
+            if (r.dbOk) refreshDepth(true);
+            return r;
+        }
+
+        // 1. 依工單 (訊息第一個欄位) 分組，組內保持 id 順序
+        vector<vector<const Row*>> groups;
+        unordered_map<string, size_t> groupIndex;
+        for (const auto& row : rows) {
+            string wo = row.msg.substr(0, row.msg.find(';'));
+            auto it = groupIndex.find(wo);
+            if (it == groupIndex.end()) {
+                it = groupIndex.emplace(wo, groups.size()).first;
+                groups.emplace_back();
+            }
+            groups[it->second].push_back(&row);
+        }
+
+        // 2. 分配到 REPLAY_WINDOW 個 worker 並行送出；任一筆失敗或續約失敗即全部停止
+        auto start = std::chrono::steady_clock::now();
+        size_t lanes = std::min<size_t>(REPLAY_WINDOW, groups.size());
+        atomic<bool> failed{false}, leaseLost{false};
+        mutex ackMutex;
+        vector<long long> acked;
+        vector<future<void>> futures;
+        for (size_t lane = 0; lane < lanes; ++lane) {
+            futures.push_back(m_pool.enqueue([&, lane]{
+                for (size_t g = lane; g < groups.size(); g += lanes) {
+                    for (const Row* row : groups[g]) {
+                        if (failed || leaseLost) return;
+                        bool delivered = false;
+                        SoapClient::sendRequest(239, row->emp, row->msg, &delivered);
+                        if (!delivered) {
+                            failed = true;
+                            return;
+                        }
+                        lock_guard<mutex> lock(ackMutex);
+                        acked.push_back(row->id);
+                    }
+                }
+            }));
+        }
+
+        // 3. 等待期間定期刪除已送出的 id 並續約；續約失敗代表租約可能被接手，停止送出
+        auto flushAcked = [&]() {
+            vector<long long> batch;
+            {
+                lock_guard<mutex> lock(ackMutex);
+                batch.swap(acked);
+            }
+            r.sent += batch.size();
+            if (!batch.empty()) deleteIds(batch);
+        };
+        for (auto& f : futures) {
+            while (f.wait_for(std::chrono::milliseconds(REPLAY_RENEW_INTERVAL_MS)) != std::future_status::ready) {
+                flushAcked();
+                if (!leaseLost && !renewClaims()) {
+                    LOG_WARN("System") << "Failed to renew backlog claim lease; stopping replay batch.";
+                    leaseLost = true;
+                    r.dbOk = false;
+                }
+            }
+            f.get();
+        }
+        flushAcked();
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        if (failed) {
+            LOG_WARN("System") << "MES send failed during buffered upload.";
+            releaseClaims();
+            m_batch = std::max(REPLAY_MIN_BATCH, m_batch / 2);
+        } else if (rows.size() >= m_batch) {
+            m_batch = std::min(REPLAY_MAX_BATCH, m_batch * 2);
+        }
+        if (r.sent > 0) LOG_INFO("System") << "Resent " << r.sent << " buffered messages (batch " << rows.size() << ").";
+
+        recordProgress(r.sent, elapsed);
+        return r;
+    }
+
+    json stats() {
+        refreshDepth(false);
+        size_t pendingDelete;
+        {
+            lock_guard<mutex> lock(m_pendingMutex);
+            pendingDelete = m_pendingDelete.size();
+        }
+        lock_guard<mutex> lock(m_statsMutex);
+        long long depth = std::max(0LL, m_depth);
+        json eta = nullptr;
+        if (depth == 0) eta = 0;
+        else if (m_rate > 0) eta = (long long)(depth / m_rate);
+        return json{{"depth", depth}, {"outbox_pending", g_outbox.pending()},
+                    {"drain_rate_per_sec", m_rate}, {"eta_seconds", eta},
+                    {"batch_size", m_batch.load()}, {"window", REPLAY_WINDOW},
+                    {"sent_total", m_sentTotal}, {"pending_delete", pendingDelete}, {"instance_id", INSTANCE_ID}, {"mes_online", g_mesBreaker.isOnline()}};
+    }
+
+    json executorStats() const { return m_pool.stats(); }
+
+private:
+    static string idList(const vector<long long>& ids, size_t begin, size_t end) {
+        string list;
+        for (size_t k = begin; k < end; ++k) {
+            if (k > begin) list += ",";
+            list += to_string(ids[k]);
+        }
+        return list;
+    }
+
+    // 已送出的 id 刪除失敗時保留在 m_pendingDelete：這些列仍由自己認領 (會一併續約)，
+    // 不會被重新送出，等 DB 恢復後再刪除
+    bool deleteIds(const vector<long long>& ids) {
+        vector<long long> failedIds;
+        DbConnection con;
+        if (!con) {
+            LOG_ERROR("System") << "No DB connection to delete " << ids.size() << " resent messages; will retry.";
+            failedIds = ids;
+        } else {
+            for (size_t i = 0; i < ids.size(); i += 1000) {
+                size_t end = std::min(ids.size(), i + 1000);
+                string delSql = "DELETE FROM 2DID_unsent_messages WHERE id IN (" + idList(ids, i, end) + ")";
+                if (mysql_query(con, delSql.c_str()) != 0) {
+                    LOG_ERROR("System") << "Failed to delete " << (end - i) << " resent messages: " << mysql_error(con);
+                    failedIds.insert(failedIds.end(), ids.begin() + i, ids.begin() + end);
+                }
+            }
+        }
+        if (failedIds.empty()) return true;
+        lock_guard<mutex> lock(m_pendingMutex);
+        m_pendingDelete.insert(failedIds.begin(), failedIds.end());
+        return false;
+    }
+
+    bool retryPendingDeletes() {
+        vector<long long> ids;
+        {
+            lock_guard<mutex> lock(m_pendingMutex);
+            if (m_pendingDelete.empty()) return true;
+            ids.assign(m_pendingDelete.begin(), m_pendingDelete.end());
+            m_pendingDelete.clear();
+        }
+        if (!deleteIds(ids)) return false;
+        LOG_INFO("System") << "Deleted " << ids.size() << " previously resent messages.";
+        return true;
+    }
+
+    bool renewClaims() {
+        DbConnection con;
+        if (!con) return false;
+        bool ok = execStmt(con, "UPDATE 2DID_unsent_messages SET claim_expires = NOW() + INTERVAL ? SECOND WHERE claim_owner = ?",
+                           {REPLAY_LEASE_SEC, INSTANCE_ID});
+        return ok;
+    }
+
+    // MES 斷線時釋放租約，讓其他 instance (或自己恢復後) 可立即接手
+    // 已送出但尚未刪除的 id 不釋放，避免被其他 instance 重送
+    void releaseClaims() {
+        string sql = "UPDATE 2DID_unsent_messages SET claim_owner = NULL, claim_expires = NULL WHERE claim_owner = ?";
+        {
+            lock_guard<mutex> lock(m_pendingMutex);
+            if (!m_pendingDelete.empty()) {
+                vector<long long> ids(m_pendingDelete.begin(), m_pendingDelete.end());
+                sql += " AND id NOT IN (" + idList(ids, 0, ids.size()) + ")";
+            }
+        }
+        DbConnection con;
+        if (!con) return;
+        execStmt(con, sql.c_str(), {INSTANCE_ID});
+    }
+
+    // 送出速率以 EWMA 平滑，積壓數量在兩次 COUNT(*) 之間以已送出筆數推估
+    void recordProgress(size_t sent, double elapsed) {
+        lock_guard<mutex> lock(m_statsMutex);
+        m_sentTotal += sent;
+        m_depth -= (long long)sent;
+        if (elapsed > 0) {
+            double rate = sent / elapsed;
+            m_rate = (m_rate == 0) ? rate : 0.7 * m_rate + 0.3 * rate;
+        }
+    }
+
+    void refreshDepth(bool empty) {
+        auto now = std::chrono::steady_clock::now();
+        {
+            lock_guard<mutex> lock(m_statsMutex);
+            if (empty) { m_depth = 0; m_lastCount = now; return; }
+            if (now - m_lastCount < std::chrono::seconds(REPLAY_COUNT_INTERVAL_SEC)) return;
+            m_lastCount = now;
+        }
+        DbConnection con;
+        if (!con) return;
+        if (mysql_query(con, "SELECT COUNT(*) FROM 2DID_unsent_messages") == 0) {
+            MYSQL_RES* res = mysql_store_result(con);
+            if (res) {
+                MYSQL_ROW row = mysql_fetch_row(res);
+                if (row && row[0]) {
+                    lock_guard<mutex> lock(m_statsMutex);
+                    m_depth = std::stoll(row[0]);
+                }
+                mysql_free_result(res);
+            }
+        }
+    }
+
+    Executor m_pool;
+    atomic<size_t> m_batch{REPLAY_MIN_BATCH};
+    mutex m_pendingMutex;
+    std::set<long long> m_pendingDelete;
+    mutex m_statsMutex;
+    long long m_depth = 0;
+    double m_rate = 0;
+    uint64_t m_sentTotal = 0;
+    std::chrono::steady_clock::time_point m_lastCount{};
+};
+
+BacklogReplayer g_replayer;
+
+// ✅ [Req 2] 背景監控與補上傳任務
+void MonitorLoop() {
+    LOG_INFO("System") << "MES Monitor Thread Started.";
+    while (true) {
+        try {
+            // ✅ 先把本地 outbox 的資料轉存 DB (DB 斷線時若 MES 在線則直接補送)
+            // 一次搬完才進入下方流程，避免 outbox 越積越多
+            while (drainOutbox() >= OUTBOX_DRAIN_BATCH) {}
+
+            if (!g_mesBreaker.isOnline()) {
+                // --- [Req 2.1] 離線模式: 斷路器冷卻中，不主動連線 ---
+                // 冷卻結束後進入半開狀態，由下方補送 (實際 239 流量) 試探 MES 是否恢復
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+            } 
+            else {
+                // --- [Req 2.2] 線上模式: 檢查積壓數據並上傳 ---
+                BacklogReplayer::Result r = g_replayer.runOnce();
+                if (!r.dbOk || r.fetched == 0) {
+                    // DB 異常或沒有積壓資料，休息久一點
+                    std::this_thread::sleep_for(std::chrono::seconds(5));
+                } else if (g_mesBreaker.isOnline() && r.sent < r.fetched) {
+                    // 部分失敗但仍在線，稍微休息避免忙碌迴圈
+                    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+                }
+                // 整批成功時立刻處理下一批
+            }
+        } catch (const std::exception& e) {
+            LOG_ERROR("Monitor") << "Exception: " << e.what();
+            std::this_thread::sleep_for(std::chrono::seconds(5)); // 出錯後休息一下再重試
+        } catch (...) {
+            LOG_ERROR("Monitor") << "Unknown Exception";
+            std::this_thread::sleep_for(std::chrono::seconds(5));
+        }
+    }
+}
+
+// /api/pcs_read 與 /api/pcs_export 共用的篩選條件
+struct PcsFilter {
+    string emp_id, product, work_order, pcs_id, time_from, time_to;
+
+    static PcsFilter fromJson(const json& x) {
+        PcsFilter f;
+        f.emp_id     = x.value("emp_id", "");
+        f.product    = x.value("product", "");
+        f.work_order = x.value("work_order", "");
+        f.pcs_id     = x.value("pcs_id", "");
+        f.time_from  = x.value("time_from", "");
+        f.time_to    = x.value("time_to", "");
+        return f;
+    }
+
+    // " WHERE 1=1 AND ..."，參數依序加入 params
+    string where(vector<BulkValue>& params) const {
+        string conditions = " WHERE 1=1";
+        auto add = [&](const char* clause, const string& v) {
+            if (v.empty()) return;
+            conditions += clause;
+            params.push_back(v);
+        };
+        add(" AND emp_id = ?", emp_id);
+        add(" AND product = ?", product);
+        add(" AND work_order = ?", work_order);
+        add(" AND pcs_id = ?", pcs_id);
+        add(" AND `timestamp` >= ?", time_from);
+        add(" AND `timestamp` <= ?", time_to);
+        return conditions;
+    }
+
+    string key() const {
+        string k;
+        for (const string* v : {&emp_id, &product, &work_order, &pcs_id, &time_from, &time_to}) k += *v + '\x1f';
+        return k;
+    }
+};
+
+// --- PCS 紀錄匯出 ---
+// ✅ [新增] 稽核用的整段匯出：一個查詢逐列 (unbuffered) 讀出並直接寫入暫存檔，
+// 再交給 Crow 以靜態檔案方式分段送出，記憶體用量與筆數無關
+struct PcsExportStats {
+    std::atomic<uint64_t> exports{0}, failed{0}, rows{0}, bytes{0};
 
-    const char* query = "INSERT INTO 2DID_scanned_products (work_order, sheet_no, panel_no, twodid_type, twodid_status, timestamp) VALUES (?, ?, ?, ?, ?, ?)";
-    MYSQL_STMT* stmt = mysql_stmt_init(con);
-    if (!stmt) { dbPool->releaseConnection(con); return; }
-    if (mysql_stmt_prepare(stmt, query, strlen(query))) { mysql_stmt_close(stmt); dbPool->releaseConnection(con); return; }
-
-    MYSQL_BIND bind[6];
-    unsigned long str_lens[5];
-    char workOrder_buf[100], sheet_buf[100], panel_buf[100], type_buf[20], status_buf[200];
-    long long ts_val;
-    memset(bind, 0, sizeof(bind));
-
-    bind[0].buffer_type = MYSQL_TYPE_STRING; bind[0].buffer = workOrder_buf; bind[0].length = &str_lens[0];
-    bind[1].buffer_type = MYSQL_TYPE_STRING; bind[1].buffer = sheet_buf; bind[1].length = &str_lens[1];
-    bind[2].buffer_type = MYSQL_TYPE_STRING; bind[2].buffer = panel_buf; bind[2].length = &str_lens[2];
-    bind[3].buffer_type = MYSQL_TYPE_STRING; bind[3].buffer = type_buf; bind[3].length = &str_lens[3];
-    bind[4].buffer_type = MYSQL_TYPE_STRING; bind[4].buffer = status_buf; bind[4].length = &str_lens[4];
-    bind[5].buffer_type = MYSQL_TYPE_LONGLONG; bind[5].buffer = &ts_val;
-
-    if (mysql_stmt_bind_param(stmt, bind)) {}
-
-    for (const auto& d : list) {
-        strncpy(workOrder_buf, d.workOrder.c_str(), sizeof(workOrder_buf)); str_lens[0] = d.workOrder.length();
-        strncpy(sheet_buf, d.sht_no.c_str(), sizeof(sheet_buf)); str_lens[1] = d.sht_no.length();
-        strncpy(panel_buf, d.panel_no.c_str(), sizeof(panel_buf)); str_lens[2] = d.panel_no.length();
-        strncpy(type_buf, d.ret_type.c_str(), sizeof(type_buf)); str_lens[3] = d.ret_type.length();
-        strncpy(status_buf, d.status.c_str(), sizeof(status_buf)); str_lens[4] = d.status.length();
-        ts_val = d.timestamp;
-        mysql_stmt_execute(stmt);
-    }
-
-    string updateOK = "UPDATE 2DID_workorder SET OK_sum = OK_sum + 1 WHERE work_order IN (";
-    string updateNG = "UPDATE 2DID_workorder SET NG_sum = NG_sum + 1 WHERE work_order IN (";
-    bool hasOK = false, hasNG = false;
-    for (const auto& d : list) {
-        if (d.ret_type == "OK") { if (hasOK) updateOK += ","; updateOK += "'" + sql_escape(d.workOrder) + "'"; hasOK = true; } 
-        else { if (hasNG) updateNG += ","; updateNG += "'" + sql_escape(d.workOrder) + "'"; hasNG = true; }
-    }
-    if (hasOK) { updateOK += ")"; mysql_query(con, updateOK.c_str()); }
-    if (hasNG) { updateNG += ")"; mysql_query(con, updateNG.c_str()); }
-
-    mysql_stmt_close(stmt);
-    mysql_query(con, "COMMIT");
-    dbPool->releaseConnection(con);
+    json stats() const {
+        return json{{"exports", exports.load()}, {"failed", failed.load()}, {"rows", rows.load()}, {"bytes", bytes.load()}};
+    }
+} g_pcsExport;
+
+// CSV 欄位：含逗號、引號或換行時以雙引號包起來，內部引號重複一次
+void appendCsvField(string& out, const string& v) {
+    if (v.find_first_of(",\"\r\n") == string::npos) { out += v; return; }
+    out += '"';
+    for (char c : v) {
+        if (c == '"') out += '"';
+        out += c;
+    }
+    out += '"';
 }
 
-// ✅ [安全修正] 改用 Prepared Statement，防止 SQL Injection
-void saveUnsentMessage(const string& emp, const string& msg) {
-    MYSQL* con = dbPool->getConnection();
-    if (!con) return;
-    
-    // 使用 ? 佔位符
-    const char* query = "INSERT INTO 2DID_unsent_messages (emp_no, message) VALUES (?, ?)";
-    
-    MYSQL_STMT* stmt = mysql_stmt_init(con);
-    if (!stmt) { dbPool->releaseConnection(con); return; }
-    
-    if (mysql_stmt_prepare(stmt, query, strlen(query))) {
-        // 記錄錯誤 log
-        cerr << "[DB Error] Prepare failed: " << mysql_stmt_error(stmt) << endl;
-        mysql_stmt_close(stmt);
-        dbPool->releaseConnection(con);
-        return;
+// 刪除超過 EXPORT_FILE_TTL_SEC 的匯出檔 (Crow 送檔時仍可能開著，因此不在回應後立即刪除)
+void sweepExportFiles() {
+    std::error_code ec;
+    auto now = std::filesystem::file_time_type::clock::now();
+    for (const auto& e : std::filesystem::directory_iterator(EXPORT_DIR, ec)) {
+        auto mtime = std::filesystem::last_write_time(e.path(), ec);
+        if (!ec && now - mtime > std::chrono::seconds(EXPORT_FILE_TTL_SEC)) std::filesystem::remove(e.path(), ec);
     }
+}
 
-    MYSQL_BIND bind[2];
-    memset(bind, 0, sizeof(bind));
-    unsigned long emp_len = emp.length();
-    unsigned long msg_len = msg.length();
+// 依篩選條件把 2did_pcs_records 寫入 path (csv / ndjson)，回傳是否成功
+bool exportPcsRecords(const PcsFilter& filter, bool csv, const string& path, uint64_t& rows) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        LOG_ERROR("Export") << "Cannot create " << path;
+        return false;
+    }
 
-    bind[0].buffer_type = MYSQL_TYPE_STRING;
-    bind[0].buffer = (char*)emp.c_str();
-    bind[0].length = &emp_len;
+    DbConnection con;
+    if (!con) return false;
 
-    bind[1].buffer_type = MYSQL_TYPE_STRING;
-    bind[1].buffer = (char*)msg.c_str();
-    bind[1].length = &msg_len;
+    vector<BulkValue> params;
+    string sql = "SELECT id, emp_id, product, work_order, pcs_id, twodid_type, twodid_status, `timestamp` "
+                 "FROM 2did_pcs_records" + filter.where(params) + " ORDER BY `timestamp` DESC, id DESC";
+    static const char* columns[] = {"id", "emp_id", "product", "work_order", "pcs_id", "twodid_type", "twodid_status", "timestamp"};
 
-    if (mysql_stmt_bind_param(stmt, bind)) {
-        cerr << "[DB Error] Bind failed: " << mysql_stmt_error(stmt) << endl;
-    } else {
-        if (mysql_stmt_execute(stmt)) {
-            cerr << "[DB Error] Execute failed: " << mysql_stmt_error(stmt) << endl;
-        }
+    // 每列先寫進同一個 line buffer 再整行寫出，不保留任何已寫出的資料
+    string line;
+    if (csv) {
+        line = "\xEF\xBB\xBF"; // UTF-8 BOM，Excel 直接開啟才不會亂碼
+        for (size_t i = 0; i < 8; ++i) { if (i) line += ','; line += columns[i]; }
+        line += "\r\n";
+        out.write(line.data(), line.size());
     }
+    rows = 0;
+    bool ok = queryStmt(con, sql, params, [&](const vector<const string*>& row) {
+        line.clear();
+        if (csv) {
+            for (size_t i = 0; i < 8; ++i) {
+                if (i) line += ',';
+                if (row[i]) appendCsvField(line, *row[i]);
+            }
+            line += "\r\n";
+        } else {
+            JsonStreamWriter w(line);
+            w.beginObject();
+            w.key("id").value(row[0] ? std::stoll(*row[0]) : 0LL);
+            for (size_t i = 1; i < 8; ++i) {
+                w.key(columns[i]);
+                if (row[i]) w.value(*row[i]); else w.null();
+            }
+            w.endObject();
+            line += '\n';
+        }
+        out.write(line.data(), line.size());
+        rows++;
+    });
+    con.release();
 
-    mysql_stmt_close(stmt);
-    dbPool->releaseConnection(con);
-}
-// ✅ [Req 3] 安全上傳函式：封裝了「嘗試傳送 -> 失敗存 DB」的邏輯
-// 這會被 write2did 與 write2dids 共用
-void SafeSoapCall(string emp, string msg) {
-    // [Req 3.2] 如果已知斷線，直接存 DB，不浪費時間連線
-    if (!g_isMesOnline) {
-        saveUnsentMessage(emp, msg);
-        return;
+    out.close();
+    if (!ok || out.fail()) {
+        std::error_code ec;
+        std::filesystem::remove(path, ec);
+        return false;
     }
+    return true;
+}
 
-    // 嘗試發送 (使用標準 3s timeout)
-    string res = SoapClient::sendRequest(239, emp, msg);
+// --- 設定資料快取 (Config Cache) ---
+// ✅ [效能優化] 平板 / IPC 每次啟動、重連都會查一次機台設定，改為依來源設定 TTL 的共用快取：
+// - TTL 內直接回傳
+// - 過期後先回傳舊值 (stale)，同時交給 executor 在背景重新載入 (同一個 key 只會有一個)
+// - 來源無法連線 (MES 離線 / DB 異常) 時持續回傳最後一次成功的資料，不再直接失敗
+// - 沒有快取時同步載入，同時的冷查詢以 single-flight 合併
+class ConfigCache {
+public:
+    enum class Status { Ok, NotFound, Unavailable };
+    struct Loaded {
+        Status status = Status::Unavailable;
+        json value;  // Ok: 要快取的資料；NotFound: 可放來源回傳的錯誤內容 (不快取)
+    };
+    using Loader = function<Loaded()>;
+
+    struct Result {
+        Status status = Status::Unavailable;
+        json value;
+        bool hit = false;       // 由快取回傳
+        bool stale = false;     // 已超過 TTL (背景重新載入中或來源無法連線)
+        double ageSec = 0;
+
+        json cacheInfo() const { return json{{"hit", hit}, {"stale", stale}, {"age_sec", std::round(ageSec * 10) / 10}}; }
+    };
+
+    explicit ConfigCache(std::map<string, int> ttlSec) : m_ttlSec(std::move(ttlSec)) {}
+
+    // loader 會在背景執行緒上執行，必須以值捕捉
+    Result get(const string& source, const string& key, Loader loader) {
+        string fullKey = source + '\x1f' + key;
+        auto ttl = std::chrono::seconds(m_ttlSec.count(source) ? m_ttlSec.at(source) : 60);
+        auto now = std::chrono::steady_clock::now();
+        Result r;
+        bool refresh = false;
+        {
+            lock_guard<mutex> lock(m_mutex);
+            auto it = m_entries.find(fullKey);
+            if (it != m_entries.end()) {
+                r.status = Status::Ok;
+                r.value = it->second.value;
+                r.hit = true;
+                r.ageSec = std::chrono::duration<double>(now - it->second.loadedAt).count();
+                r.stale = now - it->second.loadedAt > ttl;
+                if (!r.stale) m_hits++;
+                else {
+                    m_staleServed++;
+                    refresh = !it->second.refreshing;
+                    it->second.refreshing = true;
+                }
+            }
+        }
 
-    // [Req 3.1] 如果回傳空字串 (代表連線失敗)，則轉存 DB
-    if (res.empty()) {
-        if (g_isMesOnline) {
-            cout << "[MES] Connection Lost. Switching to Offline Mode." << endl;
-            g_isMesOnline = false; // 標記為離線
+        if (r.hit) {
+            if (refresh) {
+                future<void> ignored;
+                bool queued = g_executor && g_executor->tryEnqueue([this, fullKey, loader] { load(fullKey, loader); }, ignored);
+                if (!queued) {
+                    // executor 滿了：清掉旗標，下一個請求再試
+                    lock_guard<mutex> lock(m_mutex);
+                    auto it = m_entries.find(fullKey);
+                    if (it != m_entries.end()) it->second.refreshing = false;
+                }
+            }
+            return r;
         }
-        saveUnsentMessage(emp, msg);
+
+        Loaded l = load(fullKey, loader);
+        r.status = l.status;
+        r.value = std::move(l.value);
+        return r;
     }
-}
 
-// ✅ [Req 2] 背景監控與補上傳任務
-void MonitorLoop() {
-    cout << "[System] MES Monitor Thread Started." << endl;
-    while (true) {
+    json stats() {
+        lock_guard<mutex> lock(m_mutex);
+        return json{{"entries", m_entries.size()}, {"hits", m_hits}, {"stale_served", m_staleServed},
+                    {"loads", m_loads}, {"load_failures", m_loadFailures}, {"inflight", m_flight.stats()}};
+    }
+
+private:
+    struct Entry {
+        json value;
+        std::chrono::steady_clock::time_point loadedAt;
+        bool refreshing = false;
+    };
+
+    Loaded load(const string& fullKey, const Loader& loader) {
+        Loaded l;
         try {
-            if (!g_isMesOnline) {
-                // --- [Req 2.1] 離線模式: 每 5 秒 Ping 一次 (Timeout 0.5s) ---
-                bool alive = SoapClient::pingServer();
-                
-                if (alive) {
-                    cout << "[System] MES Server is Back Online!" << endl;
-                    g_isMesOnline = true; // 切換回線上模式，下次迴圈會進入下方處理積壓資料
-                } else {
-                    std::this_thread::sleep_for(std::chrono::seconds(5)); // 持續等待
-                }
-            } 
-            else {
-                // --- [Req 2.2] 線上模式: 檢查積壓數據並上傳 ---
-                MYSQL* con = dbPool->getConnection();
-                if (!con) {
-                    std::this_thread::sleep_for(std::chrono::seconds(5));
-                    continue;
-                }
+            l = m_flight.run(fullKey, loader);
+        } catch (const std::exception& e) {
+            LOG_WARN("Config") << "Load failed for " << fullKey.substr(0, fullKey.find('\x1f')) << ": " << e.what();
+        }
+        lock_guard<mutex> lock(m_mutex);
+        m_loads++;
+        auto it = m_entries.find(fullKey);
+        if (l.status == Status::Ok) {
+            m_entries[fullKey] = Entry{l.value, std::chrono::steady_clock::now(), false};
+        } else if (l.status == Status::NotFound) {
+            if (it != m_entries.end()) m_entries.erase(it); // 來源已刪除這筆設定
+        } else {
+            m_loadFailures++;
+            if (it != m_entries.end()) it->second.refreshing = false; // 保留舊值 (stale-on-error)
+        }
+        return l;
+    }
 
-                // 取出最舊的一批資料 (Batch 10)
-                string sql = "SELECT id, emp_no, message FROM 2DID_unsent_messages ORDER BY id ASC LIMIT 10";
-                if (mysql_query(con, sql.c_str()) == 0) {
-                    MYSQL_RES* res = mysql_store_result(con);
-                    if (res) {
-                        MYSQL_ROW row;
-                        vector<long long> processed_ids;
-                        
-                        while ((row = mysql_fetch_row(res))) {
-                            long long id = stoll(row[0]);
-                            string emp = row[1];
-                            string msg = row[2];
-
-                            // 嘗試補送
-                            string ret = SoapClient::sendRequest(239, emp, msg);
-
-                            if (ret.empty()) {
-                                // 發送失敗，代表又斷線了
-                                g_isMesOnline = false;
-                                cout << "[System] Connection lost during buffered upload." << endl;
-                                break; // 跳出 while 迴圈
-                            } else {
-                                // 只有成功才加入待刪除列表
-                                processed_ids.push_back(id);
-                            }
-                        }
-                        mysql_free_result(res);
+    std::map<string, int> m_ttlSec;
+    mutex m_mutex;
+    unordered_map<string, Entry> m_entries;
+    SingleFlight<Loaded> m_flight;
+    uint64_t m_hits = 0, m_staleServed = 0, m_loads = 0, m_loadFailures = 0;
+};
 
-                        // ✅ [修正] 將刪除邏輯放在這裡，確保即使 break 也能刪除已成功的 ID
-                        if (!processed_ids.empty()) {
-                            string delSql = "DELETE FROM 2DID_unsent_messages WHERE id IN (";
-                            for (size_t i = 0; i < processed_ids.size(); ++i) {
-                                if (i > 0) delSql += ",";
-                                delSql += to_string(processed_ids[i]);
-                            }
-                            delSql += ")";
-                            mysql_query(con, delSql.c_str());
-                            cout << "[System] Resent " << processed_ids.size() << " buffered messages." << endl;
-                        } 
-                        
-                        // 如果 break 了 (g_isMesOnline == false)，這裡不做 sleep，讓外層迴圈立刻進入離線 Ping 模式
-                        if (processed_ids.empty() && g_isMesOnline) {
-                            // 沒有資料需要處理，且目前連線正常，才休息久一點
-                            std::this_thread::sleep_for(std::chrono::seconds(5));
-                        }
+ConfigCache g_configCache({{"machine_code", CONFIG_TTL_MACHINE_CODE_SEC},
+                           {"cmd254", CONFIG_TTL_CMD254_SEC},
+                           {"plc_config", CONFIG_TTL_PLC_SEC}});
+
+// PM 碼 (EQM_ID) -> 機台代碼 (MACHINE_CODE)
+ConfigCache::Result lookupMachineCode(const string& pm_code) {
+    return g_configCache.get("machine_code", pm_code, [pm_code]() {
+        ConfigCache::Loaded l;
+        DbConnection con;
+        if (!con) return l;
+        string machine_code;
+        bool ok = queryStmt(con, "SELECT MACHINE_CODE FROM mes_machine WHERE EQM_ID = ?", {pm_code},
+            [&](const vector<const string*>& row) { if (machine_code.empty() && row[0]) machine_code = *row[0]; });
+        con.release();
+        if (!ok) {
+            LOG_ERROR("DB") << "machine_code query failed for " << pm_code;
+            return l;
+        }
+        l.status = machine_code.empty() ? ConfigCache::Status::NotFound : ConfigCache::Status::Ok;
+        l.value = machine_code;
+        return l;
+    });
+}
+
+// MES CMD 254 (機台硬體配置)：只快取 OK 開頭的回應；NG 回應放在 value 供呼叫端顯示
+// emp 只用於送出請求，快取以機台代碼為 key
+ConfigCache::Result lookupCmd254(const string& emp, const string& machine_code) {
+    return g_configCache.get("cmd254", machine_code, [emp, machine_code]() {
+        ConfigCache::Loaded l;
+        // [Req 4] 已知斷線時不送出 (有快取時由呼叫端沿用舊值)
+        if (!g_mesBreaker.isOnline()) return l;
+
+        LOG_INFO("MES") << "Requesting CMD 254 for Machine: " << machine_code << " by Emp: " << emp;
+        bool delivered = false;
+        string raw = SoapClient::sendRequest(254, emp, machine_code, &delivered);
+        if (raw.empty() && !delivered) return l;
+        l.status = (raw.find("OK") == 0) ? ConfigCache::Status::Ok : ConfigCache::Status::NotFound;
+        l.value = raw;
+        return l;
+    });
+}
+
+// 2did_machine_info：PLC 連線參數與點位設定
+ConfigCache::Result lookupPlcConfig(const string& machine_id) {
+    return g_configCache.get("plc_config", machine_id, [machine_id]() {
+        ConfigCache::Loaded l;
+        DbConnection con;
+        if (!con) return l;
+        json result_data;
+        bool found = false;
+        bool ok = queryStmt(con, "SELECT plc_ip, plc_port, plc_type, addr_write_trigger, addr_write_result, metadata "
+                                 "FROM 2did_machine_info WHERE machine_id = ?", {machine_id},
+            [&](const vector<const string*>& row) {
+                if (found) return;
+                found = true;
+                auto str = [](const string* v) { return v ? *v : string(); };
+                result_data["plc_ip"] = str(row[0]);
+                result_data["plc_port"] = row[1] ? std::stoi(*row[1]) : 5000;
+                result_data["plc_type"] = str(row[2]);
+                result_data["addr_write_trigger"] = str(row[3]);
+                result_data["addr_write_result"]  = str(row[4]);
+
+                // 將資料庫中的 JSON 字串安全地解析成 JSON 物件
+                result_data["metadata"] = json::object();
+                if (row[5]) {
+                    try {
+                        result_data["metadata"] = json::parse(*row[5]);
+                    } catch (const std::exception& e) {
+                        LOG_WARN("DB") << "Failed to parse metadata JSON for " << machine_id << ": " << e.what();
                     }
                 }
-                if (con) dbPool->releaseConnection(con);
-                
-                // 避免 DB 忙碌迴圈，稍微休息
-                if (g_isMesOnline) std::this_thread::sleep_for(std::chrono::milliseconds(200));
-            }
-        } catch (const std::exception& e) {
-            cerr << "[Monitor Thread Error] Exception: " << e.what() << endl;
-            std::this_thread::sleep_for(std::chrono::seconds(5)); // 出錯後休息一下再重試
-        } catch (...) {
-            cerr << "[Monitor Thread Error] Unknown Exception" << endl;
-            std::this_thread::sleep_for(std::chrono::seconds(5));
+            });
+        con.release();
+        if (!ok) {
+            LOG_ERROR("DB") << "plc_config query failed for " << machine_id;
+            return l;
         }
-    }
+        l.status = found ? ConfigCache::Status::Ok : ConfigCache::Status::NotFound;
+        l.value = result_data;
+        return l;
+    });
 }
 
 // CORS Middleware (保持不變)
@@ -765,43 +4238,276 @@ struct CORSHandler {
     }
 };
 
-// ✅ [Req 1.1] 修改 Logger 以過濾 Heartbeat
+// ✅ [效能優化] 回應壓縮 Middleware：大型 JSON (工單清單、pcs_read 分頁) 依 Accept-Encoding 以 gzip / deflate 壓縮
+// 每個執行緒保留一組 z_stream 重複使用 (deflateReset)，不需每個請求 deflateInit / deflateEnd
+struct HttpCompressionStats {
+    std::atomic<uint64_t> compressed{0}, skipped{0}, bytesIn{0}, bytesOut{0};
+
+    json stats() const {
+        uint64_t in = bytesIn.load(), out = bytesOut.load();
+        return json{{"compressed", compressed.load()}, {"skipped_small", skipped.load()}, {"bytes_in", in}, {"bytes_out", out},
+                    {"ratio", in ? (double)out / in : 0.0}};
+    }
+} g_httpCompression;
+
+struct GzipMiddleware {
+    enum class Encoding { None, Gzip, Deflate };
+    struct context {
+        Encoding encoding = Encoding::None;
+    };
+
+    void before_handle(crow::request& req, crow::response& res, context& ctx) {
+        ctx.encoding = negotiate(req.get_header_value("Accept-Encoding"));
+    }
+
+    void after_handle(crow::request& req, crow::response& res, context& ctx) {
+        if (res.body.size() < HTTP_COMPRESS_MIN_BYTES) {
+            if (ctx.encoding != Encoding::None && !res.body.empty()) g_httpCompression.skipped++;
+            return;
+        }
+        res.add_header("Vary", "Accept-Encoding");
+        if (ctx.encoding == Encoding::None || !res.get_header_value("Content-Encoding").empty()) return;
+
+        // HTTP 的 deflate 是 zlib 格式 (windowBits 15)，gzip 需加 16
+        bool gzip = (ctx.encoding == Encoding::Gzip);
+        thread_local Deflater gzipStream(15 + 16), deflateStream(15);
+        thread_local string out;
+        Deflater& z = gzip ? gzipStream : deflateStream;
+        if (!z.compress(res.body, out) || out.size() >= res.body.size()) return;
+
+        g_httpCompression.compressed++;
+        g_httpCompression.bytesIn += res.body.size();
+        g_httpCompression.bytesOut += out.size();
+        res.body.assign(out); // 沿用 body 原本的容量，不另外配置
+        res.set_header("Content-Encoding", gzip ? "gzip" : "deflate");
+        if (out.capacity() > JSON_BUFFER_KEEP_BYTES) string().swap(out);
+    }
+
+private:
+    class Deflater {
+    public:
+        explicit Deflater(int windowBits) {
+            memset(&m_zs, 0, sizeof(m_zs));
+            m_ok = deflateInit2(&m_zs, HTTP_COMPRESS_LEVEL, Z_DEFLATED, windowBits, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+        }
+        ~Deflater() { if (m_ok) deflateEnd(&m_zs); }
+        Deflater(const Deflater&) = delete;
+        Deflater& operator=(const Deflater&) = delete;
+
+        bool compress(const string& in, string& out) {
+            if (!m_ok || deflateReset(&m_zs) != Z_OK) return false;
+            out.resize(deflateBound(&m_zs, (uLong)in.size()));
+            m_zs.next_in = (Bytef*)in.data();
+            m_zs.avail_in = (uInt)in.size();
+            m_zs.next_out = (Bytef*)&out[0];
+            m_zs.avail_out = (uInt)out.size();
+            if (deflate(&m_zs, Z_FINISH) != Z_STREAM_END) return false;
+            out.resize(m_zs.total_out);
+            return true;
+        }
+
+    private:
+        z_stream m_zs;
+        bool m_ok = false;
+    };
+
+    // 解析 Accept-Encoding (例如 "gzip, deflate;q=0.5, br")，q=0 代表拒絕；gzip 優先
+    static Encoding negotiate(const string& header) {
+        bool gzip = false, gzipListed = false, deflate = false, any = false;
+        std::stringstream ss(header);
+        string item;
+        while (std::getline(ss, item, ',')) {
+            size_t semi = item.find(';');
+            string name = item.substr(0, semi);
+            name.erase(0, name.find_first_not_of(" \t"));
+            name.erase(name.find_last_not_of(" \t") + 1);
+            std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+            bool allowed = true;
+            if (semi != string::npos) {
+                size_t q = item.find("q=", semi);
+                if (q != string::npos) allowed = atof(item.c_str() + q + 2) > 0;
+            }
+            if (name == "gzip" || name == "x-gzip") { gzip = allowed; gzipListed = true; }
+            else if (name == "deflate") deflate = allowed;
+            else if (name == "*") any = allowed;
+        }
+        if (gzip || (any && !gzipListed)) return Encoding::Gzip;
+        if (deflate) return Encoding::Deflate;
+        return Encoding::None;
+    }
+};
+
+// ✅ [新增] 記錄每個 route 的請求數與延遲 (/metrics)
+struct MetricsMiddleware {
+    // route label 只使用固定的 API 路徑：其他路徑 (Crow 內建的 /static/<path>、匯出檔等) 一律記為 "other"，
+    // series 數量不會隨請求的 URL 增加而用完 MAX_SERIES。新增 API 時一併加入此清單
+    // 404 不記錄實際路徑，避免被掃描時產生大量 series
+    static const string& routeLabel(const string& url, int code) {
+        static const std::set<string> routes = {
+            "/heartbeat", "/ws/events", "/metrics", "/write_to_database",
+            "/api/backlog_status", "/api/system_stats", "/api/validate_emp", "/api/workorder", "/api/twodid",
+            "/api/write2did", "/api/write2dids", "/api/Delete_2DID", "/api/admin_login", "/api/get_ipc_config",
+            "/api/get-plc-cameras-ip", "/api/pcs_write", "/api/pcs_write_batch", "/api/pcs_read", "/api/pcs_export",
+            "/api/pcs_delete", "/api/get_machine_code", "/api/get_machine_config", "/api/get_plc_config",
+            "/api/get_plc_read_points"};
+        static const string other = "other", unmatched = "unmatched";
+        if (code == 404) return unmatched;
+        auto it = routes.find(url);
+        return it == routes.end() ? other : *it;
+    }
+
+    struct context {
+        std::chrono::steady_clock::time_point start;
+    };
+    void before_handle(crow::request& req, crow::response& res, context& ctx) {
+        ctx.start = std::chrono::steady_clock::now();
+    }
+    void after_handle(crow::request& req, crow::response& res, context& ctx) {
+        double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - ctx.start).count();
+        const string& route = routeLabel(req.url, res.code);
+        string status = to_string(res.code / 100) + "xx";
+        g_metrics.observe("backend_http_request_duration_seconds", "route=\"" + route + "\",status=\"" + status + "\"", sec);
+    }
+};
+
+// ✅ [Req 1.1] Crow 的 log 轉交給非同步 logger
+// category = "http" + 請求路徑 (例如 "http/heartbeat")，可依 LOG_LEVELS 個別關閉，不再寫死字串比對
 class CustomLogger : public crow::ILogHandler {
 public:
     void log(const std::string& message, crow::LogLevel level) override {
-        // 如果訊息包含 "/heartbeat"，則直接忽略，不印出
-        if (message.find("/heartbeat") != std::string::npos) {
-            return;
+        LogSeverity sev = LogSeverity::Info;
+        switch (level) {
+            case crow::LogLevel::Debug:   sev = LogSeverity::Debug; break;
+            case crow::LogLevel::Info:    sev = LogSeverity::Info; break;
+            case crow::LogLevel::Warning: sev = LogSeverity::Warning; break;
+            case crow::LogLevel::Error:   sev = LogSeverity::Error; break;
+            case crow::LogLevel::Critical:sev = LogSeverity::Critical; break;
         }
 
-        string levelStr;
-        switch (level) {
-            case crow::LogLevel::Debug:   levelStr = "DEBUG"; break;
-            case crow::LogLevel::Info:    levelStr = "INFO "; break;
-            case crow::LogLevel::Warning: levelStr = "WARN "; break;
-            case crow::LogLevel::Error:   levelStr = "ERROR"; break;
-            case crow::LogLevel::Critical:levelStr = "CRIT "; break;
+        // Request / Response 的訊息中第一個以 '/' 開頭的欄位是路徑
+        string category = "http";
+        size_t p = message.find(" /");
+        if (p != string::npos) {
+            size_t end = message.find_first_of(" ?", p + 1);
+            category += message.substr(p + 1, end == string::npos ? string::npos : end - p - 1);
         }
-        std::cout << "(" << getCurrentDateTimeStr() << ") [" << levelStr << "] " << message << std::endl;
+        if (g_log.enabled(sev, category)) g_log.write(sev, std::move(category), message);
     }
 };
 
 int main() {
+    // 先啟動 logger，之後所有訊息都經由背景執行緒輸出
+    g_log.configure(LOG_LEVELS);
+    g_log.configure(getEnvOr("BACKEND_LOG_LEVELS", ""));
+    g_log.start(LOG_DIR);
+
     static CustomLogger logger;
     crow::logger::setHandler(&logger);
-    dbPool = make_shared<DbPool>(DB_HOST, DB_PORT, DB_USER, DB_PASS, DB_NAME);
+    dbPool = make_shared<DbPool>(getEnvOr("BACKEND_DB_HOST", DB_HOST), DB_PORT, DB_USER, DB_PASS, DB_NAME);
+
+    g_woSpeculation.enabled = getEnvIntOr("BACKEND_SPECULATIVE_236", WORKORDER_SPECULATIVE_236 ? 1 : 0) != 0;
+
+    // 建立全域 executor (執行緒數可依產線規模調整)
+    g_executor = make_shared<Executor>("main", getEnvIntOr("BACKEND_WORKER_THREADS", WORKER_THREADS), WORKER_QUEUE_CAPACITY);
+
+    // 開啟本地 outbox (還原上次未送出的訊息)
+    g_outbox.start();
     crow::logger::setLogLevel(crow::LogLevel::Info);
 
     // 啟動背景監控執行緒
     std::thread monitorThread(MonitorLoop);
     monitorThread.detach(); 
 
-    crow::App<CORSHandler> app;
+    // 啟動掃描紀錄 write-behind writer
+    g_scanWriter.start();
+
+    // 啟動 MES 非同步 client (write2dids 批次上傳用)
+    g_mesAsync.start();
+
+    // after_handle 依宣告的反向順序執行：先壓縮，Metrics 量到的延遲包含壓縮時間
+    crow::App<CORSHandler, MetricsMiddleware, GzipMiddleware> app;
 
     // ✅ [Req 1] API: Heartbeat 
     // 前端每秒呼叫此 API，確認後端活著。Logger 已設定不顯示此紀錄。
     CROW_ROUTE(app, "/heartbeat").methods(crow::HTTPMethod::Get) ([](){
-        return crow::response(json{{"MES_alive", g_isMesOnline.load()}}.dump());
+        return crow::response(json{{"MES_alive", g_mesBreaker.isOnline()}}.dump());
+    });
+
+    // ✅ [新增] WebSocket: MES 狀態與掃描事件推播 (取代前端輪詢 /heartbeat)
+    CROW_WEBSOCKET_ROUTE(app, "/ws/events")
+        .onopen([](crow::websocket::connection& conn) {
+            g_events.add(&conn);
+            MesCircuitBreaker::State st = g_mesBreaker.state();
+            conn.send_text(EventHub::mesStatusMessage(st != MesCircuitBreaker::State::Open, MesCircuitBreaker::stateName(st)));
+        })
+        // 不同 Crow 版本的 onclose 參數不同 (有無 close code)，以 auto... 相容
+        .onclose([](crow::websocket::connection& conn, const std::string& reason, auto&&...) {
+            g_events.remove(&conn);
+        })
+        .onmessage([](crow::websocket::connection& conn, const std::string& data, bool is_binary) {
+            if (!is_binary) g_events.onMessage(&conn, data);
+        });
+
+    // ✅ [新增] API: 積壓訊息補送狀態 (積壓筆數、送出速率、預估完成時間)
+    CROW_ROUTE(app, "/api/backlog_status").methods(crow::HTTPMethod::Get) ([](){
+        return crow::response(json{{"success", true}, {"data", g_replayer.stats()}}.dump());
+    });
+
+    // ✅ [新增] API: 系統狀態 (快取命中率等內部統計)
+    // ✅ [新增] Prometheus 格式的監控指標
+    CROW_ROUTE(app, "/metrics").methods(crow::HTTPMethod::Get) ([](){
+        std::ostringstream out;
+        out << g_metrics.render();
+
+        json pool = dbPool->stats();
+        out << "# TYPE backend_db_pool_connections gauge\n";
+        Metrics::appendGauge(out, "backend_db_pool_connections", "state=\"in_use\"", pool["in_use"].get<double>());
+        Metrics::appendGauge(out, "backend_db_pool_connections", "state=\"idle\"", pool["idle"].get<double>());
+        out << "# TYPE backend_db_pool_waiters gauge\n";
+        Metrics::appendGauge(out, "backend_db_pool_waiters", "", pool["waiters"].get<double>());
+
+        out << "# TYPE backend_executor_queue_depth gauge\n";
+        json executors = json::array({g_executor->stats(), g_replayer.executorStats()});
+        for (auto& ex : executors) {
+            Metrics::appendGauge(out, "backend_executor_queue_depth", "executor=\"" + ex["name"].get<string>() + "\"", ex["queue_depth"].get<double>());
+        }
+        out << "# TYPE backend_executor_active gauge\n";
+        for (auto& ex : executors) {
+            Metrics::appendGauge(out, "backend_executor_active", "executor=\"" + ex["name"].get<string>() + "\"", ex["active"].get<double>());
+        }
+
+        json backlog = g_replayer.stats();
+        out << "# TYPE backend_unsent_backlog gauge\n";
+        Metrics::appendGauge(out, "backend_unsent_backlog", "store=\"db\"", backlog["depth"].get<double>());
+        Metrics::appendGauge(out, "backend_unsent_backlog", "store=\"outbox\"", backlog["outbox_pending"].get<double>());
+
+        out << "# TYPE backend_workorder_speculative_236_total counter\n";
+        Metrics::appendGauge(out, "backend_workorder_speculative_236_total", "outcome=\"used\"", (double)g_woSpeculation.used.load());
+        Metrics::appendGauge(out, "backend_workorder_speculative_236_total", "outcome=\"wasted\"", (double)g_woSpeculation.wasted.load());
+
+        out << "# TYPE backend_http_compressed_bytes_total counter\n";
+        Metrics::appendGauge(out, "backend_http_compressed_bytes_total", "stage=\"in\"", (double)g_httpCompression.bytesIn.load());
+        Metrics::appendGauge(out, "backend_http_compressed_bytes_total", "stage=\"out\"", (double)g_httpCompression.bytesOut.load());
+
+        out << "# TYPE backend_scan_queue_depth gauge\n";
+        Metrics::appendGauge(out, "backend_scan_queue_depth", "", g_scanWriter.stats()["queue_depth"].get<double>());
+
+        // 0 = closed, 1 = half_open, 2 = open
+        MesCircuitBreaker::State st = g_mesBreaker.state();
+        out << "# TYPE backend_mes_breaker_state gauge\n";
+        Metrics::appendGauge(out, "backend_mes_breaker_state", "", st == MesCircuitBreaker::State::Closed ? 0 : (st == MesCircuitBreaker::State::HalfOpen ? 1 : 2));
+
+        crow::response res(out.str());
+        res.set_header("Content-Type", "text/plain; version=0.0.4");
+        return res;
+    });
+
+    CROW_ROUTE(app, "/api/system_stats").methods(crow::HTTPMethod::Get) ([](){
+        return crow::response(json{{"workorder_cache", g_woCache.stats()}, {"scan_writer", g_scanWriter.stats()}, {"outbox", g_outbox.stats()}, {"mes_breaker", g_mesBreaker.stats()}, {"mes_async", g_mesAsync.stats()}, {"db_pool", dbPool->stats()}, {"logger", g_log.stats()}, {"events", g_events.stats()}, {"workorder_singleflight", g_woLookupFlight.stats()},
+                                   {"workorder_speculation", g_woSpeculation.stats()}, {"http_compression", g_httpCompression.stats()},
+                                   {"pcs_count_cache", g_pcsCountCache.stats()}, {"pcs_export", g_pcsExport.stats()},
+                                   {"config_cache", g_configCache.stats()},
+                                   {"executors", json::array({g_executor->stats(), g_replayer.executorStats()})}}.dump());
     });
 
     // ✅ [Req 5] C++ Proxy API for Employee Validation
@@ -813,16 +4519,16 @@ int main() {
             auto x = json::parse(req.body);
             empId = x.value("empId", "");
         } catch (const std::exception& e) {
-            cout << "[Proxy] JSON Parse Error: " << e.what() << endl;
+            LOG_WARN("Proxy") << "JSON Parse Error: " << e.what();
             return crow::response(400, "Invalid JSON format");
         }
 
         if (empId.empty()) {
-            cout << "[Proxy] Missing empId" << endl;
+            LOG_WARN("Proxy") << "Missing empId";
             return crow::response(400, "Missing empId");
         }
 
-        cout << "[Proxy] Forwarding request for EmpID: " << empId << endl;
+        LOG_INFO("Proxy") << "Forwarding request for EmpID: " << empId;
         
         // 2. 建構 IIS ASMX 需要的參數 (模擬 Form Data) 建構內層的 JSON 字串: {"Emp_NO": "12345"}
         json innerJson;
@@ -842,7 +4548,7 @@ int main() {
             res.add_header("Content-Type", "application/json"); 
             return res;
         } else {
-            cout << "[Proxy] IIS Failed. Status: " << r.status_code << " | Error: " << r.error.message << " | Body: " << r.text << endl;
+            LOG_ERROR("Proxy") << "IIS Failed. Status: " << r.status_code << " | Error: " << r.error.message << " | Body: " << r.text;
             
             // 回傳 502 Bad Gateway 給前端，並附上錯誤訊息
             return crow::response(502, json{ {"success", false}, {"message", "IIS Server Error: " + to_string(r.status_code)} }.dump());
@@ -877,52 +4583,13 @@ int main() {
         // cout << "employee ID: " << emp << endl;
         // cout << "insertDB: " << insertDB << endl;
 
-        // 1. 先查本地 DB
-        json dbResult = readWorkOrderFromDB(wo);
-        if (dbResult != nullptr) return crow::response(json{{"success", true}, {"source", "DB"}, {"data", dbResult}}.dump());
-
-        // 2. 檢查連線狀態 (Fast Fail)
-        // [Req 4] 若已知斷線，直接回傳錯誤，不讓前端空等
-        if (!g_isMesOnline) {
-            return crow::response(json{{"success", false}, {"type", "mes_offline"}, {"message", "因與 IT server 網路中斷，因此工單查詢失敗"}}.dump());
-        }
-
-        // 3. 嘗試 CMD 235
-        string res235 = SoapClient::sendRequest(235, emp, wo);
-        
-        // [Req 4] 二次檢查：如果回傳空字串，代表連線剛剛超時或失敗了
-        if (res235.empty() && !g_isMesOnline) {
-            return crow::response(json{{"success", false}, {"type", "mes_offline"}, {"message", "因與 IT server 網路中斷，因此工單查詢失敗"}}.dump());
-        }
-
-        WorkOrderData d235 = parseSoapResponse(res235, wo, 235);
-        if (d235.valid) {
-            if (insertDB) saveWorkOrderToDB(d235);
-            json j; j["workorder"] = d235.workorder; j["item"] = d235.item; j["workStep"] = d235.workStep; j["panel_num"] = d235.panel_num; j["cmd236_flag"] = d235.cmd236_flag;
-            j["sht_no"] = d235.sht_no; j["panel_no"] = d235.panel_no; j["twodid_step"] = d235.twodid_step; j["twodid_type"] = d235.twodid_type;
-            j["scanned_data"] = nullptr; 
-            return crow::response(json{{"success", true}, {"source", "API235"}, {"data", j}}.dump());
-        }
-
-        // 4. 嘗試 CMD 236
-        // 如果 235 只是查無資料(但連線正常)，才繼續查 236
-        string res236 = SoapClient::sendRequest(236, emp, wo);
-
-        // [Req 4] 同樣檢查 236 的連線狀況
-        if (res236.empty() && !g_isMesOnline) {
-            return crow::response(json{{"success", false}, {"type", "mes_offline"}, {"message", "因與 IT server 網路中斷，因此工單查詢失敗"}}.dump());
-        }
-
-        WorkOrderData d236 = parseSoapResponse(res236, wo, 236);
-        if (d236.valid) {
-            if (insertDB) saveWorkOrderToDB(d236);
-            json j; j["workorder"] = d236.workorder; j["item"] = d236.item; j["workStep"] = d236.workStep; j["panel_num"] = d236.panel_num; j["cmd236_flag"] = d236.cmd236_flag;
-            j["sht_no"] = d236.sht_no; j["panel_no"] = d236.panel_no; j["twodid_step"] = d236.twodid_step; j["twodid_type"] = d236.twodid_type;
-            j["scanned_data"] = nullptr;
-            return crow::response(json{{"success", true}, {"source", "API236"}, {"data", j}}.dump());
-        }
-
-        return crow::response(json{{"success", false}, {"message", res236}}.dump());
+        // ✅ [效能優化] 同一工單的同時查詢只執行一次 (換班時多台平板同時查詢同一張工單)
+        // insert_to_database 不同的呼叫不合併，避免不寫 DB 的查詢結果被要寫入的呼叫共用
+        string key = wo + '\x1f' + (insertDB ? "1" : "0");
+        shared_ptr<string> body = g_woLookupFlight.run(key, [&] { return lookupWorkOrder(wo, emp, insertDB); });
+        // 沒有其他請求共用這份結果時 (single-flight 的共享狀態已釋放) 直接搬進回應，不再複製
+        if (body.use_count() == 1) return crow::response(std::move(*body));
+        return crow::response(*body);
     });
 
     // API 3: CMD 238
@@ -930,12 +4597,13 @@ int main() {
         auto x = json::parse(req.body);
         
         // [Req 4] 檢查連線狀態
-        if (!g_isMesOnline) return crow::response(json{{"success", false}, {"type", "mes_offline"}, {"message", "因與 IT server 網路中斷，因此 2DID 資訊查詢失敗"}}.dump());
+        if (!g_mesBreaker.isOnline()) return crow::response(json{{"success", false}, {"type", "mes_offline"}, {"message", "因與 IT server 網路中斷，因此 2DID 資訊查詢失敗"}}.dump());
 
-        string raw = SoapClient::sendRequest(238, x["emp_no"], x["twodid"]);
+        bool delivered = false;
+        string raw = SoapClient::sendRequest(238, x["emp_no"], x["twodid"], &delivered);
 
         // [Req 4] 檢查是否因為 timeout 導致回傳空字串
-        if (raw.empty() && !g_isMesOnline) return crow::response(json{{"success", false}, {"type", "mes_offline"}, {"message", "因與 IT server 網路中斷，因此 2DID 資訊查詢失敗"}}.dump());
+        if (raw.empty() && !delivered) return crow::response(json{{"success", false}, {"type", "mes_offline"}, {"message", "因與 IT server 網路中斷，因此 2DID 資訊查詢失敗"}}.dump());
         if (raw.find("OK") == 0) return crow::response(json{{"success", true}, {"result", {{"result", raw}}}}.dump());
         return crow::response(json{{"success", false}, {"message", "Not Found"}}.dump());
     });
@@ -1018,9 +4686,11 @@ int main() {
             vector<ScannedData> list;
             list.push_back({wo, sht, pnl, x["twodid_type"], x["remark"], 
                 std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count()});
-            saveScannedListToDB(list);
+            // ✅ [效能優化] 交給 write-behind 合併 commit；佇列滿時退回同步寫入
+            ScanWriteBehind::Result stored = storeScans(list);
+            if (scanStoreFailed(stored)) return scanStoreFailure(stored);
 
-            return crow::response(json{{"success", true}, {"mes_status", g_isMesOnline ? "online" : "offline"}}.dump());
+            return crow::response(json{{"success", true}, {"mes_status", g_mesBreaker.isOnline() ? "online" : "offline"}}.dump());
         } catch (const std::exception& e) {
             return crow::response(400, json{{"success", false}, {"message", "Invalid JSON format"}}.dump());
         }
@@ -1038,7 +4708,8 @@ int main() {
 
             string emp = listJson[0].value("emp_no", ""); 
             vector<ScannedData> dbList;
-            vector<future<void>> futures; 
+            vector<string> msgs;
+            vector<future<MesAsyncClient::Result>> futures; 
 
             for (const auto& x : listJson) {
                 string wo = x.value("workOrder", "");
@@ -1054,7 +4725,7 @@ int main() {
                 string entryTime = x.value("entryTime", "");
                 if (entryTime.empty() || !isValidDateTime(entryTime)) {
                     // Batch 模式下，若時間格式錯誤則略過該筆 (或視需求改為 return 400)
-                    cout << "[Batch Error] Skipping item due to invalid entryTime: " << entryTime << endl;
+                    LOG_WARN("API") << "Skipping item due to invalid entryTime: " << entryTime;
                     continue; 
                 }
 
@@ -1074,28 +4745,24 @@ int main() {
                 // ✅ [修改] 更新 SOAP 訊息格式
                 string msg = wo + ";" + item + ";" + step + ";" + sht + ";" + pnl + ";" + step + ";" + entryTime + ";" + exitTime + ";" + type_code + ";" + rem + ";;";
                 
-                if (g_isMesOnline) {
-                    futures.push_back(g_threadPool.enqueue([emp, msg](){
-                        SafeSoapCall(emp, msg); 
-                    }));
-                } else {
-                    saveUnsentMessage(emp, msg);
-                }
+                // ✅ [效能優化] 交給非同步 client，視窗內的請求同時進行，不再每 10 筆等待一次
+                // (斷路器開啟時會立即回傳失敗，下方統一寫入 outbox)
+                futures.push_back(g_mesAsync.submit(239, emp, msg));
+                msgs.push_back(msg);
 
                 dbList.push_back({wo, sht, pnl, ret, rem, std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count()});
-
-                if (futures.size() >= 10) {
-                    for (auto& f : futures) f.get();
-                    futures.clear();
-                }
             }
 
-            for (auto& f : futures) f.get(); 
-            saveScannedListToDB(dbList);
+            // [Req 3.1] 與 SafeSoapCall 相同：沒有送達 MES 的訊息寫入 outbox
+            for (size_t i = 0; i < futures.size(); ++i) {
+                if (!futures[i].get().delivered) g_outbox.append(emp, msgs[i]);
+            }
+            ScanWriteBehind::Result stored = storeScans(dbList);
+            if (scanStoreFailed(stored)) return scanStoreFailure(stored);
 
-            return crow::response(json{{"success", true}, {"count", dbList.size()}, {"mes_status", g_isMesOnline ? "online" : "offline"}}.dump());
+            return crow::response(json{{"success", true}, {"count", dbList.size()}, {"mes_status", g_mesBreaker.isOnline() ? "online" : "offline"}}.dump());
         } catch (const std::exception& e) { 
-            cout << "[API Error] write2dids JSON Parse Error: " << e.what() << endl;
+            LOG_ERROR("API") << "write2dids JSON Parse Error: " << e.what();
             return crow::response(400, "Invalid JSON Format");
         }
     });
@@ -1109,27 +4776,24 @@ int main() {
             
             if (wo.empty()) return crow::response(400, "Missing workorder");
 
-            MYSQL* con = dbPool->getConnection();
+            DbConnection con;
             if (con) {
                 // 改用 Prepared Statement 刪除
                 const char* query = "DELETE FROM 2DID_workorder WHERE work_order = ?";
-                MYSQL_STMT* stmt = mysql_stmt_init(con);
+                MYSQL_STMT* stmt = dbPool->prepareCached(con, query);
                 if (stmt) {
-                    if (mysql_stmt_prepare(stmt, query, strlen(query)) == 0) {
-                        MYSQL_BIND bind[1];
-                        memset(bind, 0, sizeof(bind));
-                        unsigned long wo_len = wo.length();
-                        bind[0].buffer_type = MYSQL_TYPE_STRING;
-                        bind[0].buffer = (char*)wo.c_str();
-                        bind[0].length = &wo_len;
-                        
-                        mysql_stmt_bind_param(stmt, bind);
-                        mysql_stmt_execute(stmt);
-                    }
-                    mysql_stmt_close(stmt);
+                    MYSQL_BIND bind[1];
+                    memset(bind, 0, sizeof(bind));
+                    unsigned long wo_len = wo.length();
+                    bind[0].buffer_type = MYSQL_TYPE_STRING;
+                    bind[0].buffer = (char*)wo.c_str();
+                    bind[0].length = &wo_len;
+                    
+                    mysql_stmt_bind_param(stmt, bind);
+                    mysql_stmt_execute(stmt);
                 }
-                dbPool->releaseConnection(con);
             }
+            g_woCache.invalidate(wo);
             return crow::response(json{{"success", true}}.dump());
         } catch (const std::exception& e) {
             return crow::response(400, "Invalid JSON");
@@ -1144,7 +4808,7 @@ int main() {
 
             if (empId.empty()) return crow::response(400, "Missing empId");
 
-            MYSQL* con = dbPool->getConnection();
+            DbConnection con;
             bool isAdmin = false;
             if (con) {
                 // 查詢該工號是否存在於 admin 表中
@@ -1156,7 +4820,6 @@ int main() {
                         mysql_free_result(res);
                     }
                 }
-                dbPool->releaseConnection(con);
             }
 
             if (isAdmin) {
@@ -1179,24 +4842,16 @@ int main() {
                 return crow::response(400, json{{"success", false}, {"message", "Missing emp_no or machine_code"}}.dump());
             }
 
-            // [Req 4] 檢查連線狀態，若斷線直接 Fast Fail
-            if (!g_isMesOnline) {
-                return crow::response(json{{"success", false}, {"type", "mes_offline"}, {"message", "因與 IT server 網路中斷，無法查詢機台配置"}}.dump());
-            }
-
-            cout << "[MES] Requesting CMD 254 for Machine: " << machine_code << " by Emp: " << emp << endl;
-
-            // 呼叫 SOAP CMD 254
-            string raw = SoapClient::sendRequest(254, emp, machine_code);
-
-            // 檢查是否因為 Timeout 導致連線失敗 (SafeSoapCall 邏輯的查詢版本)
-            if (raw.empty() && !g_isMesOnline) {
+            // ✅ [效能優化] CMD 254 經由設定快取：MES 斷線 (或 timeout) 時回傳最後一次成功的資料
+            ConfigCache::Result cfg = lookupCmd254(emp, machine_code);
+            if (cfg.status == ConfigCache::Status::Unavailable) {
                 return crow::response(json{{"success", false}, {"type", "mes_offline"}, {"message", "因與 IT server 網路中斷，無法查詢機台配置"}}.dump());
             }
 
             // 如果成功獲取資料 (通常以 OK 開頭)
-            if (raw.find("OK") == 0) {
-                return crow::response(json{{"success", true}, {"raw_data", raw}}.dump());
+            string raw = cfg.value.get<string>();
+            if (cfg.status == ConfigCache::Status::Ok) {
+                return crow::response(json{{"success", true}, {"raw_data", raw}, {"cache", cfg.cacheInfo()}}.dump());
             }
 
             // MES 回傳錯誤訊息
@@ -1249,7 +4904,7 @@ int main() {
                 return crow::response(400, json{{"success", false}, {"message", "Missing required fields: emp_id/product/work_order/pcs_id/twodid_type"}}.dump());
             }
 
-            MYSQL* con = dbPool->getConnection();
+            DbConnection con;
             if (!con) return crow::response(500, json{{"success", false}, {"message", "DB connection failed"}}.dump());
 
             bool hasTs = !ts.empty();
@@ -1263,15 +4918,11 @@ int main() {
                 "INSERT INTO 2did_pcs_records (emp_id, product, work_order, pcs_id, twodid_type, twodid_status) "
                 "VALUES (?, ?, ?, ?, ?, ?)";
 
-            MYSQL_STMT* stmt = mysql_stmt_init(con);
-            if (!stmt) { dbPool->releaseConnection(con); return crow::response(500, "DB stmt init failed"); }
-
+            // ✅ [效能優化] 使用連線池快取的 prepared statement (不需 close)
             const char* query = hasTs ? q_with_ts : q_no_ts;
-            if (mysql_stmt_prepare(stmt, query, strlen(query)) != 0) {
-                string err = mysql_stmt_error(stmt);
-                mysql_stmt_close(stmt);
-                dbPool->releaseConnection(con);
-                return crow::response(500, json{{"success", false}, {"message", "Prepare failed: " + err}}.dump());
+            MYSQL_STMT* stmt = dbPool->prepareCached(con, query);
+            if (!stmt) {
+                return crow::response(500, json{{"success", false}, {"message", string("Prepare failed: ") + mysql_error(con)}}.dump());
             }
 
             // ✅ Bind 陣列大小從 6 改為 7
@@ -1320,22 +4971,16 @@ int main() {
 
             if (mysql_stmt_bind_param(stmt, bind) != 0) {
                 string err = mysql_stmt_error(stmt);
-                mysql_stmt_close(stmt);
-                dbPool->releaseConnection(con);
                 return crow::response(500, json{{"success", false}, {"message", "Bind failed: " + err}}.dump());
             }
 
             if (mysql_stmt_execute(stmt) != 0) {
                 string err = mysql_stmt_error(stmt);
-                mysql_stmt_close(stmt);
-                dbPool->releaseConnection(con);
                 return crow::response(500, json{{"success", false}, {"message", "Execute failed: " + err}}.dump());
             }
 
             auto newId = (unsigned long long)mysql_insert_id(con);
 
-            mysql_stmt_close(stmt);
-            dbPool->releaseConnection(con);
 
             return crow::response(json{{"success", true}, {"id", newId}}.dump());
         } catch (const std::exception& e) {
@@ -1343,6 +4988,112 @@ int main() {
         }
     });
 
+    // ✅ [新增] API: PCS Write Batch
+    // IPC 站點一次上傳多筆：一次驗證、一個交易、多列 INSERT，回傳每筆的 id 或錯誤
+    CROW_ROUTE(app, "/api/pcs_write_batch").methods(crow::HTTPMethod::Post)
+    ([&isValidDateTime](const crow::request& req){
+        try {
+            auto x = json::parse(req.body);
+            const json& records = x.is_array() ? x : x.at("records");
+            if (!records.is_array() || records.empty()) {
+                return crow::response(400, json{{"success", false}, {"message", "records must be a non-empty array"}}.dump());
+            }
+            if (records.size() > PCS_BATCH_MAX_ITEMS) {
+                return crow::response(413, json{{"success", false}, {"message", "Too many records (max " + to_string(PCS_BATCH_MAX_ITEMS) + ")"}}.dump());
+            }
+
+            // 1. 一次驗證全部，有 timestamp 與沒有的分成兩組 (欄位不同)
+            struct Row { size_t index; string emp_id, product, work_order, pcs_id, twodid_type, twodid_status, ts; };
+            vector<Row> withTs, noTs;
+            json results = json::array();
+            size_t failed = 0;
+            for (size_t i = 0; i < records.size(); ++i) {
+                results.push_back({{"index", i}, {"success", false}});
+                try {
+                    const json& r = records[i];
+                    Row row{i, r.value("emp_id", ""), r.value("product", ""), r.value("work_order", ""), r.value("pcs_id", ""),
+                            r.value("twodid_type", ""), r.value("twodid_status", ""), r.value("timestamp", "")};
+                    if (row.emp_id.empty() || row.product.empty() || row.work_order.empty() || row.pcs_id.empty() || row.twodid_type.empty()) {
+                        results[i]["message"] = "Missing required fields: emp_id/product/work_order/pcs_id/twodid_type";
+                        failed++;
+                        continue;
+                    }
+                    if (!row.ts.empty() && !isValidDateTime(row.ts)) {
+                        results[i]["message"] = "Invalid timestamp format. Expected YYYY-MM-DD HH:MM:SS";
+                        failed++;
+                        continue;
+                    }
+                    (row.ts.empty() ? noTs : withTs).push_back(std::move(row));
+                } catch (const std::exception& e) {
+                    results[i]["message"] = string("Invalid record: ") + e.what();
+                    failed++;
+                }
+            }
+
+            if (withTs.empty() && noTs.empty()) {
+                return crow::response(400, json{{"success", false}, {"inserted", 0}, {"failed", failed}, {"results", results}}.dump());
+            }
+
+            DbConnection con;
+            if (!con) return crow::response(500, json{{"success", false}, {"message", "DB connection failed"}}.dump());
+
+            // 多列 INSERT 的 id 間隔 (一般為 1，multi-master 環境可能不同)。
+            // 只有 innodb_autoinc_lock_mode <= 1 時單一多列 INSERT 的 id 保證連續，才能由第一個 id 推回每筆的 id；
+            // 2 (interleaved，MySQL 8 預設) 時並行的 INSERT 會交錯取號，此時不回傳 id
+            long long step = 1, lockMode = 2;
+            queryStmt(con, "SELECT @@SESSION.auto_increment_increment, @@GLOBAL.innodb_autoinc_lock_mode", {},
+                      [&](const vector<const string*>& row) {
+                          if (row[0]) step = std::stoll(*row[0]);
+                          if (row[1]) lockMode = std::stoll(*row[1]);
+                      });
+            bool idsReliable = (lockMode <= 1);
+
+            // 2. 一個交易內以多列 INSERT 寫入，依 statement 回傳的第一個 id 推回每筆的 id
+            mysql_query(con, "START TRANSACTION");
+            bool ok = true;
+            string err;
+            vector<pair<size_t, unsigned long long>> ids;
+            auto insertGroup = [&](const vector<Row>& rows, bool hasTs) {
+                if (!ok || rows.empty()) return;
+                BulkInsertWriter writer(con, hasTs
+                    ? "INSERT INTO 2did_pcs_records (emp_id, product, work_order, pcs_id, twodid_type, twodid_status, `timestamp`)"
+                    : "INSERT INTO 2did_pcs_records (emp_id, product, work_order, pcs_id, twodid_type, twodid_status)",
+                    hasTs ? 7 : 6);
+                for (const auto& r : rows) {
+                    bool added = hasTs ? writer.add({r.emp_id, r.product, r.work_order, r.pcs_id, r.twodid_type, r.twodid_status, r.ts})
+                                       : writer.add({r.emp_id, r.product, r.work_order, r.pcs_id, r.twodid_type, r.twodid_status});
+                    if (!added) break;
+                }
+                if (!writer.flush()) { ok = false; err = writer.error(); return; }
+                size_t k = 0;
+                for (const auto& c : writer.chunks()) {
+                    for (size_t j = 0; j < c.second; ++j, ++k) ids.push_back({rows[k].index, (unsigned long long)(c.first + j * step)});
+                }
+            };
+            insertGroup(withTs, true);
+            insertGroup(noTs, false);
+
+            ok = ok && (mysql_query(con, "COMMIT") == 0);
+            if (!ok) {
+                if (err.empty()) err = mysql_error(con);
+                mysql_query(con, "ROLLBACK");
+            }
+            con.release();
+
+            // DB 失敗時整批 rollback，驗證通過的資料全部回報同一個錯誤
+            if (!ok) {
+                return crow::response(500, json{{"success", false}, {"message", "Insert failed: " + err}, {"results", results}}.dump());
+            }
+            for (const auto& kv : ids) {
+                results[kv.first]["success"] = true;
+                if (idsReliable) results[kv.first]["id"] = kv.second;
+            }
+            return crow::response(json{{"success", true}, {"inserted", ids.size()}, {"failed", failed}, {"results", results}}.dump());
+        } catch (const std::exception& e) {
+            return crow::response(400, json{{"success", false}, {"message", string("Invalid JSON: ") + e.what()}}.dump());
+        }
+    });
+
     // API: PCS Read
     CROW_ROUTE(app, "/api/pcs_read").methods(crow::HTTPMethod::Post)
     ([](const crow::request& req){
@@ -1350,13 +5101,7 @@ int main() {
             auto x = json::parse(req.body);
 
             // ✅ 新增 emp_id 讀取
-            string emp_id     = x.value("emp_id", "");
-            string product    = x.value("product", "");
-            string work_order = x.value("work_order", "");
-            string pcs_id     = x.value("pcs_id", "");
-
-            string time_from  = x.value("time_from", ""); 
-            string time_to    = x.value("time_to", "");
+            PcsFilter filter = PcsFilter::fromJson(x);
 
             int page = x.value("page", 1);
             int pageSize = x.value("pageSize", 50);
@@ -1364,37 +5109,40 @@ int main() {
             if (pageSize < 1) pageSize = 50;
             if (pageSize > 500) pageSize = 500; 
 
-            MYSQL* con = dbPool->getConnection();
+            // ✅ [效能優化] cursor 模式：帶上一頁最後一筆的 (timestamp, id)，由該位置往後 seek，
+            // 不再 OFFSET 掃過再丟棄前面的資料，翻到多深的頁數成本都一樣
+            bool useCursor = false;
+            string cursorTs;
+            long long cursorId = 0;
+            if (x.contains("cursor") && x["cursor"].is_object()) {
+                cursorTs = x["cursor"].value("timestamp", "");
+                cursorId = x["cursor"].value("id", 0LL);
+                useCursor = !cursorTs.empty();
+            }
+            // 不需要總筆數時 (例如只做「載入更多」) 可傳 with_count=false 省掉 COUNT(*)
+            bool withCount = x.value("with_count", true);
+
+            DbConnection con;
             if (!con) return crow::response(500, json{{"success", false}, {"message", "DB connection failed"}}.dump());
 
-            // ✅ 將 WHERE 條件獨立拉出來，這樣 COUNT 和 SELECT 可以共用
-            string conditions = " WHERE 1=1";
-            if (!emp_id.empty())     conditions += " AND emp_id = '" + sql_escape(emp_id) + "'";
-            if (!product.empty())    conditions += " AND product = '" + sql_escape(product) + "'";
-            if (!work_order.empty()) conditions += " AND work_order = '" + sql_escape(work_order) + "'";
-            if (!pcs_id.empty())     conditions += " AND pcs_id = '" + sql_escape(pcs_id) + "'";
-            if (!time_from.empty())  conditions += " AND `timestamp` >= '" + sql_escape(time_from) + "'";
-            if (!time_to.empty())    conditions += " AND `timestamp` <= '" + sql_escape(time_to) + "'";
+            // ✅ 將 WHERE 條件獨立拉出來，這樣 COUNT 和 SELECT 可以共用 (改用 bound parameter)
+            vector<BulkValue> params;
+            string conditions = filter.where(params);
 
             // ==========================================
             // 步驟 1: 計算總筆數 (Total Count) 與 總頁數 (Total Pages)
             // ==========================================
+            // 同一組篩選條件在 PCS_COUNT_CACHE_TTL_MS 內共用同一個 COUNT(*) 結果
             long long total_count = 0;
-            string count_sql = "SELECT COUNT(*) FROM 2did_pcs_records" + conditions;
-            
-            if (mysql_query(con, count_sql.c_str()) == 0) {
-                MYSQL_RES* resCount = mysql_store_result(con);
-                if (resCount) {
-                    MYSQL_ROW row = mysql_fetch_row(resCount);
-                    if (row && row[0]) {
-                        total_count = std::stoll(row[0]);
-                    }
-                    mysql_free_result(resCount);
+            bool countCached = false;
+            string countKey = filter.key();
+            if (withCount && !(countCached = g_pcsCountCache.get(countKey, total_count))) {
+                bool ok = queryStmt(con, "SELECT COUNT(*) FROM 2did_pcs_records" + conditions, params,
+                    [&](const vector<const string*>& row) { if (row[0]) total_count = std::stoll(*row[0]); });
+                if (!ok) {
+                    return crow::response(500, json{{"success", false}, {"message", "Count query failed"}}.dump());
                 }
-            } else {
-                string err = mysql_error(con);
-                dbPool->releaseConnection(con);
-                return crow::response(500, json{{"success", false}, {"message", "Count query failed: " + err}}.dump());
+                g_pcsCountCache.put(countKey, total_count);
             }
 
             // 計算總頁數 (無條件進位算法)
@@ -1403,50 +5151,63 @@ int main() {
             // ==========================================
             // 步驟 2: 查詢該頁的實際資料
             // ==========================================
-            // ✅ SELECT 加入 emp_id
+            // 多取一筆判斷是否還有下一頁；id 作為同一 timestamp 的排序依據，cursor 才能唯一定位
+            // (建議索引：ALTER TABLE 2did_pcs_records ADD INDEX idx_pcs_ts_id (`timestamp`, id))
             string sql = "SELECT id, emp_id, product, work_order, pcs_id, twodid_type, twodid_status, `timestamp` "
                          "FROM 2did_pcs_records" + conditions;
-
-            sql += " ORDER BY `timestamp` DESC";
-            sql += " LIMIT " + to_string(pageSize) + " OFFSET " + to_string((page - 1) * pageSize);
+            vector<BulkValue> pageParams = params;
+            if (useCursor) {
+                sql += " AND (`timestamp` < ? OR (`timestamp` = ? AND id < ?))";
+                pageParams.push_back(cursorTs);
+                pageParams.push_back(cursorTs);
+                pageParams.push_back(cursorId);
+            }
+            sql += " ORDER BY `timestamp` DESC, id DESC";
+            sql += " LIMIT ?";
+            pageParams.push_back(pageSize + 1);
+            if (!useCursor) {
+                sql += " OFFSET ?";
+                pageParams.push_back((long long)(page - 1) * pageSize);
+            }
 
             json items = json::array();
-
-            if (mysql_query(con, sql.c_str()) == 0) {
-                MYSQL_RES* res = mysql_store_result(con);
-                if (res) {
-                    MYSQL_ROW row;
-                    while ((row = mysql_fetch_row(res))) {
-                        json it;
-                        it["id"]            = row[0] ? std::stoull(row[0]) : 0;
-                        it["emp_id"]        = row[1] ? row[1] : ""; // ✅ 解析 emp_id
-                        it["product"]       = row[2] ? row[2] : ""; // 後面的 Index 配合往後推一格
-                        it["work_order"]    = row[3] ? row[3] : "";
-                        it["pcs_id"]        = row[4] ? row[4] : "";
-                        it["twodid_type"]   = row[5] ? row[5] : "";
-                        it["twodid_status"] = row[6] ? row[6] : "";
-                        it["timestamp"]     = row[7] ? row[7] : "";
-                        items.push_back(it);
-                    }
-                    mysql_free_result(res);
-                }
-            } else {
-                string err = mysql_error(con);
-                dbPool->releaseConnection(con);
-                return crow::response(500, json{{"success", false}, {"message", "Query failed: " + err}}.dump());
+            auto str = [](const string* v) { return v ? *v : string(); };
+            bool ok = queryStmt(con, sql, pageParams, [&](const vector<const string*>& row) {
+                json it;
+                it["id"]            = row[0] ? std::stoull(*row[0]) : 0;
+                it["emp_id"]        = str(row[1]);
+                it["product"]       = str(row[2]);
+                it["work_order"]    = str(row[3]);
+                it["pcs_id"]        = str(row[4]);
+                it["twodid_type"]   = str(row[5]);
+                it["twodid_status"] = str(row[6]);
+                it["timestamp"]     = str(row[7]);
+                items.push_back(std::move(it));
+            });
+            if (!ok) {
+                return crow::response(500, json{{"success", false}, {"message", "Query failed"}}.dump());
             }
 
-            dbPool->releaseConnection(con);
+            con.release();
+
+            bool hasMore = items.size() > (size_t)pageSize;
+            if (hasMore) items.erase(items.size() - 1);
+            json nextCursor = nullptr;
+            if (hasMore) nextCursor = {{"timestamp", items.back()["timestamp"]}, {"id", items.back()["id"]}};
 
             // ✅ 將 total_count, total_pages 一併包在 Response 裡回傳給前端
+            // next_cursor 為 null 代表已是最後一頁；with_count=false 時 total_count / total_pages 為 null
             return crow::response(json{
                 {"success", true}, 
                 {"items", items},
                 {"pagination", {
                     {"current_page", page},
                     {"page_size", pageSize},
-                    {"total_count", total_count},
-                    {"total_pages", total_pages}
+                    {"total_count", withCount ? json(total_count) : json(nullptr)},
+                    {"total_pages", withCount ? json(total_pages) : json(nullptr)},
+                    {"count_cached", countCached},
+                    {"has_more", hasMore},
+                    {"next_cursor", nextCursor}
                 }}
             }.dump());
 
@@ -1455,6 +5216,56 @@ int main() {
         }
     });
 
+    // ✅ [新增] API: PCS Export
+    // 整段篩選結果一次匯出 (csv / ndjson)，取代逐頁呼叫 /api/pcs_read；GET 以 query string、POST 以 JSON 帶條件
+    CROW_ROUTE(app, "/api/pcs_export").methods(crow::HTTPMethod::Get, crow::HTTPMethod::Post)
+    ([](const crow::request& req){
+        try {
+            json x = json::object();
+            if (req.method == crow::HTTPMethod::Post) {
+                x = json::parse(req.body);
+            } else {
+                for (const char* k : {"emp_id", "product", "work_order", "pcs_id", "time_from", "time_to", "format"}) {
+                    if (const char* v = req.url_params.get(k)) x[k] = v;
+                }
+            }
+            string format = x.value("format", "csv");
+            if (format != "csv" && format != "ndjson") {
+                return crow::response(400, json{{"success", false}, {"message", "format must be csv or ndjson"}}.dump());
+            }
+            bool csv = (format == "csv");
+            PcsFilter filter = PcsFilter::fromJson(x);
+
+            std::error_code ec;
+            std::filesystem::create_directories(EXPORT_DIR, ec);
+            sweepExportFiles();
+
+            static std::atomic<uint64_t> seq{0};
+            long long nowMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+            string name = "pcs_" + to_string(nowMs) + "_" + to_string(seq++) + (csv ? ".csv" : ".ndjson");
+            string path = EXPORT_DIR + "/" + name;
+
+            uint64_t rows = 0;
+            if (!exportPcsRecords(filter, csv, path, rows)) {
+                g_pcsExport.failed++;
+                return crow::response(500, json{{"success", false}, {"message", "Export failed"}}.dump());
+            }
+            g_pcsExport.exports++;
+            g_pcsExport.rows += rows;
+            g_pcsExport.bytes += std::filesystem::file_size(path, ec);
+            LOG_INFO("Export") << name << ": " << rows << " rows";
+
+            crow::response res;
+            res.set_static_file_info(path);
+            res.set_header("Content-Type", csv ? "text/csv; charset=utf-8" : "application/x-ndjson");
+            res.set_header("Content-Disposition", "attachment; filename=\"" + name + "\"");
+            res.set_header("X-Export-Rows", to_string(rows));
+            return res;
+        } catch (const std::exception& e) {
+            return crow::response(400, json{{"success", false}, {"message", string("Invalid request: ") + e.what()}}.dump());
+        }
+    });
+
     // API: PCS Delete
     CROW_ROUTE(app, "/api/pcs_delete").methods(crow::HTTPMethod::Post)
     ([](const crow::request& req){
@@ -1469,23 +5280,16 @@ int main() {
                 return crow::response(400, json{{"success", false}, {"message", "Missing required field: pcs_id"}}.dump());
             }
 
-            MYSQL* con = dbPool->getConnection();
+            DbConnection con;
             if (!con) return crow::response(500, json{{"success", false}, {"message", "DB connection failed"}}.dump());
 
             // 定義 DELETE 語法
             const char* query = "DELETE FROM 2did_pcs_records WHERE pcs_id = ?";
 
-            MYSQL_STMT* stmt = mysql_stmt_init(con);
-            if (!stmt) { 
-                dbPool->releaseConnection(con); 
-                return crow::response(500, "DB stmt init failed"); 
-            }
-
-            if (mysql_stmt_prepare(stmt, query, strlen(query)) != 0) {
-                string err = mysql_stmt_error(stmt);
-                mysql_stmt_close(stmt);
-                dbPool->releaseConnection(con);
-                return crow::response(500, json{{"success", false}, {"message", "Prepare failed: " + err}}.dump());
+            // ✅ [效能優化] 使用連線池快取的 prepared statement (不需 close)
+            MYSQL_STMT* stmt = dbPool->prepareCached(con, query);
+            if (!stmt) {
+                return crow::response(500, json{{"success", false}, {"message", string("Prepare failed: ") + mysql_error(con)}}.dump());
             }
 
             // 綁定參數 (只有一個 pcs_id)
@@ -1500,23 +5304,17 @@ int main() {
 
             if (mysql_stmt_bind_param(stmt, bind) != 0) {
                 string err = mysql_stmt_error(stmt);
-                mysql_stmt_close(stmt);
-                dbPool->releaseConnection(con);
                 return crow::response(500, json{{"success", false}, {"message", "Bind failed: " + err}}.dump());
             }
 
             if (mysql_stmt_execute(stmt) != 0) {
                 string err = mysql_stmt_error(stmt);
-                mysql_stmt_close(stmt);
-                dbPool->releaseConnection(con);
                 return crow::response(500, json{{"success", false}, {"message", "Execute failed: " + err}}.dump());
             }
 
             // 取得實際被刪除的筆數
             long long deleted_count = mysql_stmt_affected_rows(stmt);
 
-            mysql_stmt_close(stmt);
-            dbPool->releaseConnection(con);
 
             // 將刪除筆數一併回傳給前端
             return crow::response(json{
@@ -1543,36 +5341,14 @@ int main() {
                 return crow::response(400, json{{"success", false}, {"message", "Missing pm_code"}}.dump());
             }
 
-            MYSQL* con = dbPool->getConnection();
-            if (!con) return crow::response(500, json{{"success", false}, {"message", "DB connection failed"}}.dump());
-
-            // 根據你的需求，查詢 mes_machine_process 表
-            string sql = "SELECT MACHINE_CODE FROM mes_machine WHERE EQM_ID = '" + sql_escape(pm_code) + "'";
-            
-            string machine_code = "";
-            bool found = false;
-
-            if (mysql_query(con, sql.c_str()) == 0) {
-                MYSQL_RES* res = mysql_store_result(con);
-                if (res) {
-                    MYSQL_ROW row = mysql_fetch_row(res);
-                    if (row && row[0]) {
-                        machine_code = row[0];
-                        found = true;
-                    }
-                    mysql_free_result(res);
-                }
-            } else {
-                string err = mysql_error(con);
-                dbPool->releaseConnection(con);
-                cout << "[DB Error] get_machine_code query failed: " << err << endl;
+            // 根據你的需求，查詢 mes_machine_process 表 (經由設定快取)
+            ConfigCache::Result cfg = lookupMachineCode(pm_code);
+            if (cfg.status == ConfigCache::Status::Unavailable) {
                 return crow::response(500, json{{"success", false}, {"message", "Query failed"}}.dump());
             }
 
-            dbPool->releaseConnection(con);
-
-            if (found) {
-                return crow::response(json{{"success", true}, {"machine_code", machine_code}}.dump());
+            if (cfg.status == ConfigCache::Status::Ok) {
+                return crow::response(json{{"success", true}, {"machine_code", cfg.value}, {"cache", cfg.cacheInfo()}}.dump());
             } else {
                 return crow::response(404, json{{"success", false}, {"message", "找不到該 PM 碼對應的機台代碼"}}.dump());
             }
@@ -1598,45 +5374,24 @@ int main() {
             // ---------------------------------------------------------
             // 步驟 1: 透過 PM 碼 (EQM_ID) 查詢機台代碼 (MACHINE_CODE)
             // ---------------------------------------------------------
-            MYSQL* con = dbPool->getConnection();
-            if (!con) return crow::response(500, json{{"success", false}, {"message", "DB connection failed"}}.dump());
-
-            // 依照你提供的 SQL 語法，查詢 mes_machine_process 表
-            string sql = "SELECT MACHINE_CODE FROM mes_machine WHERE EQM_ID = '" + sql_escape(pm_code) + "'";
-            string machine_code = "";
-
-            if (mysql_query(con, sql.c_str()) == 0) {
-                MYSQL_RES* res = mysql_store_result(con);
-                if (res) {
-                    MYSQL_ROW row = mysql_fetch_row(res);
-                    if (row && row[0]) machine_code = row[0];
-                    mysql_free_result(res);
-                }
-            } else {
-                string err = mysql_error(con);
-                dbPool->releaseConnection(con);
-                cout << "[DB Error] get_machine_config query failed: " << err << endl;
+            ConfigCache::Result codeCfg = lookupMachineCode(pm_code);
+            if (codeCfg.status == ConfigCache::Status::Unavailable) {
                 return crow::response(500, json{{"success", false}, {"message", "DB Query failed"}}.dump());
             }
-            dbPool->releaseConnection(con);
-
-            if (machine_code.empty()) {
+            if (codeCfg.status == ConfigCache::Status::NotFound) {
                 return crow::response(404, json{{"success", false}, {"message", "找不到該 PM 碼對應的機台代碼"}}.dump());
             }
+            string machine_code = codeCfg.value.get<string>();
 
             // ---------------------------------------------------------
             // 步驟 2: 拿著機台代碼向 MES (CMD 254) 請求硬體配置
             // ---------------------------------------------------------
-            if (!g_isMesOnline) {
-                return crow::response(json{{"success", false}, {"type", "mes_offline"}, {"message", "因與 IT server 網路中斷，無法查詢機台配置"}}.dump());
-            }
-
-            cout << "[MES] Requesting CMD 254 for Machine: " << machine_code << " by Emp: " << emp << endl;
-            string raw = SoapClient::sendRequest(254, emp, machine_code);
-
-            if (raw.empty() && !g_isMesOnline) {
+            // MES 斷線時沿用最後一次成功的配置 (回應的 cache 標示資料年齡)
+            ConfigCache::Result cfg = lookupCmd254(emp, machine_code);
+            if (cfg.status == ConfigCache::Status::Unavailable) {
                 return crow::response(json{{"success", false}, {"type", "mes_offline"}, {"message", "因與 IT server 網路中斷，無法查詢機台配置"}}.dump());
             }
+            string raw = cfg.value.get<string>();
 
             // ---------------------------------------------------------
             // 步驟 3: 解析 MES 回傳的字串並組裝成 JSON
@@ -1690,7 +5445,7 @@ int main() {
 
                 result_data["camera_ip"] = camera_ip;
 
-                return crow::response(json{{"success", true}, {"data", result_data}}.dump());
+                return crow::response(json{{"success", true}, {"data", result_data}, {"cache", cfg.cacheInfo()}}.dump());
             } 
             else if (raw.find("NG;") == 0) {
                 // 如果 MES 回傳 NG，提取分號後面的錯誤訊息
@@ -1719,52 +5474,13 @@ int main() {
                 return crow::response(400, json{{"success", false}, {"message", "Missing machine_id"}}.dump());
             }
 
-            MYSQL* con = dbPool->getConnection();
-            if (!con) return crow::response(500, json{{"success", false}, {"message", "DB connection failed"}}.dump());
-
-            string sql = "SELECT plc_ip, plc_port, plc_type, addr_write_trigger, addr_write_result, metadata "
-                         "FROM 2did_machine_info WHERE machine_id = '" + sql_escape(machine_id) + "'";
-            
-            json result_data;
-            bool found = false;
-
-            if (mysql_query(con, sql.c_str()) == 0) {
-                MYSQL_RES* res = mysql_store_result(con);
-                if (res) {
-                    MYSQL_ROW row = mysql_fetch_row(res);
-                    if (row) {
-                        found = true;
-                        result_data["plc_ip"] = row[0] ? row[0] : "";
-                        result_data["plc_port"] = row[1] ? std::stoi(row[1]) : 5000;
-                        result_data["plc_type"] = row[2] ? row[2] : "";
-                        result_data["addr_write_trigger"] = row[3] ? row[3] : "";
-                        result_data["addr_write_result"]  = row[4] ? row[4] : "";
-                        
-                        // 將資料庫中的 JSON 字串安全地解析成 JSON 物件
-                        if (row[5]) {
-                            try {
-                                result_data["metadata"] = json::parse(row[5]);
-                            } catch (const std::exception& e) {
-                                cout << "[DB Warn] Failed to parse metadata JSON for " << machine_id << ": " << e.what() << endl;
-                                result_data["metadata"] = json::object(); // 解析失敗就給空物件防呆
-                            }
-                        } else {
-                            result_data["metadata"] = json::object();
-                        }
-                    }
-                    mysql_free_result(res);
-                }
-            } else {
-                string err = mysql_error(con);
-                dbPool->releaseConnection(con);
-                cout << "[DB Error] get_plc_config query failed: " << err << endl;
+            ConfigCache::Result cfg = lookupPlcConfig(machine_id);
+            if (cfg.status == ConfigCache::Status::Unavailable) {
                 return crow::response(500, json{{"success", false}, {"message", "Query failed"}}.dump());
             }
 
-            dbPool->releaseConnection(con);
-
-            if (found) {
-                return crow::response(json{{"success", true}, {"data", result_data}}.dump());
+            if (cfg.status == ConfigCache::Status::Ok) {
+                return crow::response(json{{"success", true}, {"data", cfg.value}, {"cache", cfg.cacheInfo()}}.dump());
             } else {
                 return crow::response(404, json{{"success", false}, {"message", "找不到該機台的 PLC 配置設定"}}.dump());
             }
@@ -1848,5 +5564,14 @@ int main() {
         }
     });
 
-    app.port(2151).multithreaded().run();
+    LOG_INFO("System") << "Instance ID: " << INSTANCE_ID;
+    app.port(getEnvIntOr("BACKEND_PORT", SERVER_PORT)).multithreaded().run();
+
+    // 服務停止後，把 write-behind 佇列中尚未寫入的掃描紀錄寫完
+    LOG_INFO("System") << "Flushing pending scan records...";
+    g_mesAsync.stop();
+    g_scanWriter.shutdown();
+    g_executor.reset();
+    g_outbox.stop();
+    g_log.stop();
 }
\ No newline at end of file